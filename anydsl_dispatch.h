@@ -0,0 +1,125 @@
+/*
+  Runtime ISA dispatch for the AnyDSL example libraries.
+
+  add_anydsl_library() compiles the Impala sources once per entry of
+  ANYDSL_IA_TARGETS, each time with a different target descriptor
+  (targets/<isa>.impala) and -march, and renames every entry point to
+  <entry>_<isa>.  It then generates a small C file that includes this
+  header and uses ANYDSL_DISPATCH(<entry>) once per entry point.  The macro
+  defines <entry> as a GNU indirect function whose resolver runs when the
+  library is loaded and picks the widest variant that both the CPU and the
+  OS support, the same way ispc's multi-target dispatch does.  Callers keep
+  declaring and calling <entry> with its real signature.
+
+  ANYDSL_HAVE_SSE4, ANYDSL_HAVE_AVX2 and ANYDSL_HAVE_AVX512 are defined for
+  the variants that were actually built.
+*/
+
+#ifndef ANYDSL_DISPATCH_H
+#define ANYDSL_DISPATCH_H
+
+#include <cpuid.h>
+#include <stddef.h>
+
+enum {
+    ANYDSL_ISA_SSE4,
+    ANYDSL_ISA_AVX2,
+    ANYDSL_ISA_AVX512,
+    ANYDSL_NUM_ISAS
+};
+
+typedef void (*anydsl_entry_t)(void);
+
+static inline unsigned long long anydsl_xgetbv(void) {
+    unsigned int eax, edx;
+    __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((unsigned long long)edx << 32) | eax;
+}
+
+/* Returns the widest ISA usable on this machine, or -1 if not even SSE4.2
+   is available.  AVX and AVX-512 also need the OS to save the extended
+   register state, which XCR0 tells. */
+static inline int anydsl_host_isa(void) {
+    unsigned int eax, ebx, ecx, edx;
+    int isa = -1;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return isa;
+    if ((ecx & bit_SSE4_1) && (ecx & bit_SSE4_2))
+        isa = ANYDSL_ISA_SSE4;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) || !(ecx & bit_FMA))
+        return isa;
+
+    unsigned long long xcr0 = anydsl_xgetbv();
+    if ((xcr0 & 0x6) != 0x6)  // XMM and YMM state
+        return isa;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return isa;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (!(ebx & bit_AVX2) || !(ebx & bit_BMI2))
+        return isa;
+    isa = ANYDSL_ISA_AVX2;
+
+    // Skylake-SP subset: F, DQ, BW and VL, plus opmask and ZMM state
+    if ((ebx & bit_AVX512F) && (ebx & bit_AVX512DQ) &&
+        (ebx & bit_AVX512BW) && (ebx & bit_AVX512VL) &&
+        (xcr0 & 0xe6) == 0xe6)
+        isa = ANYDSL_ISA_AVX512;
+    return isa;
+}
+
+/* Picks the widest built variant the host can run.  If the host is below
+   every built variant, the narrowest one is returned anyway; calling it
+   will then fault with an illegal instruction, as an ispc binary would. */
+static inline anydsl_entry_t anydsl_select(const anydsl_entry_t variants[ANYDSL_NUM_ISAS]) {
+    for (int isa = anydsl_host_isa(); isa >= 0; --isa)
+        if (variants[isa])
+            return variants[isa];
+    for (int isa = 0; isa < ANYDSL_NUM_ISAS; ++isa)
+        if (variants[isa])
+            return variants[isa];
+    return NULL;
+}
+
+#ifdef ANYDSL_HAVE_SSE4
+#define ANYDSL_DECLARE_SSE4(fn) extern void fn##_sse4(void);
+#define ANYDSL_VARIANT_SSE4(fn) fn##_sse4
+#else
+#define ANYDSL_DECLARE_SSE4(fn)
+#define ANYDSL_VARIANT_SSE4(fn) NULL
+#endif
+
+#ifdef ANYDSL_HAVE_AVX2
+#define ANYDSL_DECLARE_AVX2(fn) extern void fn##_avx2(void);
+#define ANYDSL_VARIANT_AVX2(fn) fn##_avx2
+#else
+#define ANYDSL_DECLARE_AVX2(fn)
+#define ANYDSL_VARIANT_AVX2(fn) NULL
+#endif
+
+#ifdef ANYDSL_HAVE_AVX512
+#define ANYDSL_DECLARE_AVX512(fn) extern void fn##_avx512(void);
+#define ANYDSL_VARIANT_AVX512(fn) fn##_avx512
+#else
+#define ANYDSL_DECLARE_AVX512(fn)
+#define ANYDSL_VARIANT_AVX512(fn) NULL
+#endif
+
+/* The variants are declared as void(void) only to take their addresses;
+   the resolver returns one of them unchanged, so the caller's view of the
+   signature is the one that counts. */
+#define ANYDSL_DISPATCH(fn)                                                 \
+    ANYDSL_DECLARE_SSE4(fn)                                                 \
+    ANYDSL_DECLARE_AVX2(fn)                                                 \
+    ANYDSL_DECLARE_AVX512(fn)                                               \
+    static anydsl_entry_t fn##_resolve(void) {                              \
+        const anydsl_entry_t variants[ANYDSL_NUM_ISAS] = {                  \
+            ANYDSL_VARIANT_SSE4(fn),                                        \
+            ANYDSL_VARIANT_AVX2(fn),                                        \
+            ANYDSL_VARIANT_AVX512(fn)                                       \
+        };                                                                  \
+        return anydsl_select(variants);                                     \
+    }                                                                       \
+    void fn(void) __attribute__((ifunc(#fn "_resolve")));
+
+#endif // ANYDSL_DISPATCH_H
@@ -49,23 +49,25 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <vector>
 #include <sys/types.h>
 
 #include "ao_ispc.h"
 using namespace ispc;
 
-#include "../timing.h"
+#include "../bench.h"
 
 #define NSUBSAMPLES        2
 
 extern void ao_serial(int w, int h, int nsubsamples, float image[]);
 extern "C" void ao_impala(int w, int h, int nsubsamples, float image[]);
+extern "C" void ao_impala_tasks(int w, int h, int nsubsamples, float image[]);
 
-static unsigned int test_iterations[] = {3, 7, 1};
+// 0 leaves the number of runs to the benchmark harness
+static unsigned int test_iterations[] = {0, 0, 0};
 static unsigned int width, height;
 static unsigned char *img;
 static float *fimg;
-static double* times;
 
 static unsigned char
 clamp(float f)
@@ -80,7 +82,7 @@ clamp(float f)
 
 
 static void
-savePPM(const char *fname, int w, int h)
+savePPM(const char *fname, int w, int h, FILE *log)
 {
     for (int y = 0; y < h; y++) {
         for (int x = 0; x < w; x++)  {
@@ -101,18 +103,14 @@ savePPM(const char *fname, int w, int h)
     fprintf(fp, "255\n");
     fwrite(img, w * h * 3, 1, fp);
     fclose(fp);
-    printf("Wrote image file %s\n", fname);
-}
-
-static double
-median(double* times, size_t n) {
-    if (n == 0) return 0.0f;
-    std::sort(times, times + n);
-    return times[n/2];
+    fprintf(log, "Wrote image file %s\n", fname);
 }
 
 int main(int argc, char **argv)
 {
+    Bench bench("aobench");
+    argc = bench.parseArgs(argc, argv);
+
     if (argc < 3) {
         printf ("%s\n", argv[0]);
         printf ("Usage: ao [width] [height] [ispc iterations] [AnyDSL iterations] [serial iterations]\n");
@@ -128,31 +126,42 @@ int main(int argc, char **argv)
         width = atoi (argv[1]);
         height = atoi (argv[2]);
     }
-    unsigned int maxIter = std::max(test_iterations[0], std::max(test_iterations[1], test_iterations[2]));
 
     // Allocate space for output images
     img = new unsigned char[width * height * 3];
     fimg = new float[width * height * 3];
-    times = new double[maxIter];
-
-#define BENCH(iter, fn, res, name) \
-    for (unsigned int i = 0; i < iter; i++) { \
-        memset((void *)fimg, 0, sizeof(float) * width * height * 3); \
-        assert(NSUBSAMPLES == 2); \
-        reset_and_start_timer(); \
-        fn(width, height, NSUBSAMPLES, fimg); \
-        double t = get_elapsed_mcycles(); \
-        printf("@time of " name " run:\t\t\t[%.3f] million cycles\n", t); \
-        times[i] = t; \
-    } \
-    double res = median(times, iter); \
-    printf("[aobench " name "]:\t\t\t[%.3f] million cycles (%d x %d image)\n", res, width, height); \
-    savePPM("ao-" name ".ppm", width, height); \
-
-    BENCH(test_iterations[0], ao_ispc,   timeISPC, "ispc")
-    BENCH(test_iterations[1], ao_impala, timeImpala, "impala")
-    BENCH(test_iterations[2], ao_serial, timeSerial, "serial")
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", timeSerial / timeISPC, timeSerial / timeImpala);
+
+    // Every version draws the same random numbers (philox.h), so their
+    // images differ only by floating point rounding.
+    std::map<std::string, std::vector<float> > images;
+
+#define BENCH(iter, fn, name) \
+    bench.run(name, iter, \
+              [&] { fn(width, height, NSUBSAMPLES, fimg); }, \
+              [&] { memset((void *)fimg, 0, sizeof(float) * width * height * 3); }); \
+    savePPM("ao-" name ".ppm", width, height, bench.logFile()); \
+    images[name].assign(fimg, fimg + width * height * 3);
+
+    assert(NSUBSAMPLES == 2);
+    BENCH(test_iterations[0], ao_ispc,   "ispc")
+    BENCH(test_iterations[1], ao_impala, "impala")
+    BENCH(test_iterations[0], ao_ispc_tasks,   "ispc-tasks")
+    BENCH(test_iterations[1], ao_impala_tasks, "impala-tasks")
+    BENCH(test_iterations[2], ao_serial, "serial")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("serial", "ispc"), bench.speedup("serial", "impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("serial", "ispc-tasks"), bench.speedup("serial", "impala-tasks"));
+
+    const std::vector<float> &reference = images["serial"];
+    for (auto &image : images) {
+        float maxDiff = 0.f;
+        for (size_t i = 0; i < reference.size(); ++i)
+            maxDiff = std::max(maxDiff, fabsf(image.second[i] - reference[i]));
+        if (image.first != "serial")
+            fprintf(bench.logFile(), "%s: max difference from serial %g\n",
+                    image.first.c_str(), maxDiff);
+    }
 
     return 0;
 }
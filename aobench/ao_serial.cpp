@@ -44,19 +44,7 @@
 
 #include <stdlib.h>
 #include <math.h>
-
-#ifdef _MSC_VER
-static long long drand48_x = 0x1234ABCD330E;
-
-static inline void srand48(int x) {
-    drand48_x = x ^ (x << 16);
-}
-
-static inline double drand48() {
-    drand48_x = drand48_x * 0x5DEECE66D + 0xB;
-    return (drand48_x & 0xFFFFFFFFFFFF) * (1.0 / 281474976710656.0);
-}
-#endif // _MSC_VER
+#include "../philox.h"
 
 #ifdef _MSC_VER
 __declspec(align(16))
@@ -86,6 +74,7 @@ inline vec operator*(float f, const vec &v) { return vec(f*v.x, f*v.y, f*v.z); }
 
 
 #define NAO_SAMPLES		8
+#define AO_SEED			0x5EED
 
 #ifdef M_PI
 #undef M_PI
@@ -201,9 +190,11 @@ orthoBasis(vec basis[3], const vec &n) {
 }
 
 
+// The random numbers of a sample depend only on the pixel, the subsample
+// within it and the sample number, like in ao.ispc and ao.impala.
 static float
 ambient_occlusion(Isect &isect, Plane &plane,
-                  Sphere spheres[3]) {
+                  Sphere spheres[3], uint32_t pixel, uint32_t subsample) {
     float eps = 0.0001f;
     vec p, n;
     vec basis[3];
@@ -220,8 +211,9 @@ ambient_occlusion(Isect &isect, Plane &plane,
             Ray ray;
             Isect occIsect;
 
-            float theta = sqrtf(drand48());
-            float phi   = 2.0f * M_PI * drand48();
+            Random4 rnd = random4(pixel, subsample, j * nphi + i, AO_SEED);
+            float theta = sqrtf(random_unit(rnd.x));
+            float phi   = 2.0f * M_PI * random_unit(rnd.y);
             float x = cosf(phi) * theta;
             float y = sinf(phi) * theta;
             float z = sqrtf(1.0f - theta * theta);
@@ -263,8 +255,6 @@ static void ao_scanlines(int y0, int y1, int w, int h, int nsubsamples,
         { vec(-0.5f, 0.0f, -3.0f), 0.5f },
         { vec(1.0f, 0.0f, -2.2f), 0.5f } };
 
-    srand48(y0);
-
     for (int y = y0; y < y1; ++y) {
         for (int x = 0; x < w; ++x)  {
             int offset = 3 * (y * w + x);
@@ -295,7 +285,7 @@ static void ao_scanlines(int y0, int y1, int w, int h, int nsubsamples,
                     ray_plane_intersect(isect, ray, plane);
 
                     if (isect.hit)
-                        ret = ambient_occlusion(isect, plane, spheres);
+                        ret = ambient_occlusion(isect, plane, spheres, y * w + x, u * nsubsamples + v);
 
                     // Update image for AO for this ray
                     image[offset+0] += ret;
@@ -0,0 +1,378 @@
+/*
+  Shared benchmark harness for the example drivers.
+
+  Every driver registers its ispc / impala / serial variants with a Bench
+  object.  Each variant is run a few times untimed (warmup) and then timed
+  repeatedly until the 95% confidence interval of the median metric is
+  within a relative target, or until the run limit is reached.  The interval
+  is the distribution-free one between two order statistics of the samples,
+  which needs at least 6 runs.  Results are
+  reported as min/median/mean/stddev, both as human readable lines and
+  optionally as JSON or CSV for automated collection.
+
+  Command line options understood by Bench::parseArgs() (they are removed
+  from argv so the drivers can keep parsing their positional arguments):
+
+    --bench-format=text|json|csv   machine readable report format
+    --bench-output=<file>          write the report to <file> (default: stdout)
+    --bench-warmup=<n>             untimed runs before measuring (default: 1)
+    --bench-min-runs=<n>           minimum number of timed runs (default: 3)
+    --bench-max-runs=<n>           maximum number of timed runs (default:
+                                   BENCH_DEFAULT_MAX_RUNS, or the iteration
+                                   count given on the example's command line)
+    --bench-ci=<fraction>          relative 95% CI half-width to stop at
+                                   (default: 0.02)
+    --bench-no-counters            don't collect hardware performance counters
+
+  Where perf events are accessible, every timed run also collects the
+  counters from perfcounters.h and reports instructions per cycle, cache,
+  branch and TLB misses per kernel run and an estimate of the bytes read
+  from DRAM.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "timing.h"
+#include "perfcounters.h"
+
+/* Run limit for variants whose run count is left to the harness; most
+   converge to the CI target well before it. */
+#define BENCH_DEFAULT_MAX_RUNS 30
+
+enum BenchFormat {
+    BENCH_FORMAT_TEXT,
+    BENCH_FORMAT_JSON,
+    BENCH_FORMAT_CSV
+};
+
+// ci95 is the half-width of the 95% confidence interval of the median, or
+// half the range of the samples when there are too few for one.
+struct BenchStats {
+    double min, median, mean, stddev, ci95;
+};
+
+struct BenchMetric {
+    std::string name;
+    std::vector<double> samples;
+    BenchStats stats;
+};
+
+struct BenchResult {
+    std::string variant;
+    unsigned int warmup;
+    unsigned int runs;
+    bool converged;
+    std::vector<BenchMetric> metrics;
+
+    const BenchMetric *metric(const char *name) const {
+        for (size_t i = 0; i < metrics.size(); ++i)
+            if (metrics[i].name == name)
+                return &metrics[i];
+        return NULL;
+    }
+
+    double median() const { return metrics.empty() ? 0.0 : metrics[0].stats.median; }
+};
+
+/* Rank j (1-based) of the order statistics x_(j) <= x_(n+1-j) of n sorted
+   samples that bound a distribution-free 95% confidence interval of their
+   median: the largest j with P(Binomial(n, 1/2) < j) <= 2.5%.  Returns 0
+   for fewer than 6 samples, where no such interval exists. */
+static inline size_t
+bench_median_ci_rank(size_t n) {
+    double cdf = 0.0;
+    size_t j = 0;
+    for (size_t k = 0; k < n; ++k) {
+        cdf += exp(lgamma(n + 1.0) - lgamma(k + 1.0) - lgamma(n - k + 1.0) - n * log(2.0));
+        if (cdf > 0.025)
+            break;
+        j = k + 1;
+    }
+    return j;
+}
+
+static inline BenchStats
+bench_stats(std::vector<double> samples) {
+    BenchStats s = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+    size_t n = samples.size();
+    if (n == 0) return s;
+
+    std::sort(samples.begin(), samples.end());
+    s.min = samples[0];
+    s.median = (n & 1) ? samples[n/2] : 0.5 * (samples[n/2 - 1] + samples[n/2]);
+
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        sum += samples[i];
+    s.mean = sum / n;
+
+    if (n > 1) {
+        double sq = 0.0;
+        for (size_t i = 0; i < n; ++i)
+            sq += (samples[i] - s.mean) * (samples[i] - s.mean);
+        s.stddev = sqrt(sq / (n - 1));
+    }
+    size_t j = bench_median_ci_rank(n);
+    s.ci95 = j ? 0.5 * (samples[n - j] - samples[j - 1]) : 0.5 * (samples[n - 1] - samples[0]);
+    return s;
+}
+
+class Bench {
+public:
+    explicit Bench(const char *name)
+        : suite(name), format(BENCH_FORMAT_TEXT), warmup(1), minRuns(3),
+          maxRuns(0), ciTarget(0.02), log(stdout), noCounters(false), counters(NULL) {}
+
+    ~Bench() {
+        report();
+        delete counters;
+    }
+
+    /* Consumes the --bench-* options and returns the new argc. */
+    int parseArgs(int argc, char *argv[]) {
+        int out = 1;
+        for (int i = 1; i < argc; ++i) {
+            const char *a = argv[i];
+            if (strncmp(a, "--bench-format=", 15) == 0) {
+                if (strcmp(a + 15, "json") == 0)
+                    format = BENCH_FORMAT_JSON;
+                else if (strcmp(a + 15, "csv") == 0)
+                    format = BENCH_FORMAT_CSV;
+                else if (strcmp(a + 15, "text") == 0)
+                    format = BENCH_FORMAT_TEXT;
+                else {
+                    fprintf(stderr, "Unknown benchmark format \"%s\"\n", a + 15);
+                    exit(1);
+                }
+            } else if (strncmp(a, "--bench-output=", 15) == 0) {
+                output = a + 15;
+            } else if (strncmp(a, "--bench-warmup=", 15) == 0) {
+                warmup = atoi(a + 15);
+            } else if (strncmp(a, "--bench-min-runs=", 17) == 0) {
+                minRuns = std::max(1, atoi(a + 17));
+            } else if (strncmp(a, "--bench-max-runs=", 17) == 0) {
+                maxRuns = std::max(1, atoi(a + 17));
+            } else if (strncmp(a, "--bench-ci=", 11) == 0) {
+                ciTarget = atof(a + 11);
+            } else if (strcmp(a, "--bench-no-counters") == 0) {
+                noCounters = true;
+            } else {
+                argv[out++] = argv[i];
+            }
+        }
+        argv[out] = NULL;
+
+        // Keep stdout clean for the report when it isn't going to a file.
+        if (format != BENCH_FORMAT_TEXT && output.empty())
+            log = stderr;
+
+        // Open the counters before any task system threads exist, so that
+        // they inherit them.
+        if (!noCounters) {
+            counters = new PerfCounters;
+            if (!counters->available()) {
+                delete counters;
+                counters = NULL;
+            }
+        }
+        return out;
+    }
+
+    /* Times fn() until the median is known to within the CI target.
+       setup() runs untimed before every run.  runs is 0 to leave the run
+       limit to the harness, or an iteration count the user passed on the
+       example's command line, which then is the upper bound; either is
+       overridden by --bench-max-runs.  If fn() performs a known number of operations
+       (launches, tasks, ...), pass it as ops to also report the time per
+       operation as the usec_per_op metric. */
+    BenchResult run(const char *variant, unsigned int runs,
+                    const std::function<void()> &fn,
+                    const std::function<void()> &setup = std::function<void()>(),
+                    double ops = 0.0) {
+        unsigned int hi = maxRuns ? maxRuns : runs ? runs : BENCH_DEFAULT_MAX_RUNS;
+        unsigned int lo = std::min(minRuns, hi);
+
+        BenchResult r;
+        r.variant = variant;
+        r.warmup = warmup;
+        r.runs = 0;
+        r.converged = false;
+        r.metrics.resize(counters ? 9 : 2);
+        r.metrics[0].name = "mcycles";
+        r.metrics[1].name = "msec";
+        if (counters) {
+            r.metrics[2].name = "instructions";
+            r.metrics[3].name = "ipc";
+            r.metrics[4].name = "l1d_misses";
+            r.metrics[5].name = "llc_misses";
+            r.metrics[6].name = "branch_misses";
+            r.metrics[7].name = "dtlb_misses";
+            r.metrics[8].name = "dram_mbytes";
+        }
+
+        for (unsigned int i = 0; i < warmup; ++i) {
+            if (setup) setup();
+            fn();
+        }
+
+        while (r.runs < hi) {
+            if (setup) setup();
+            Timer timer;
+            if (counters) counters->start();
+            timer_start(&timer);
+            fn();
+            TimerSample t = timer_stop(&timer);
+            double mcycles = t.cycles * 1e-6;
+            double msec = t.ns * 1e-6;
+            r.metrics[0].samples.push_back(mcycles);
+            r.metrics[1].samples.push_back(msec);
+            if (counters) {
+                PerfCounterValues c = counters->stop();
+                r.metrics[2].samples.push_back(c.count[PERF_INSTRUCTIONS]);
+                r.metrics[3].samples.push_back(c.ipc());
+                r.metrics[4].samples.push_back(c.count[PERF_L1D_MISSES]);
+                r.metrics[5].samples.push_back(c.count[PERF_LLC_MISSES]);
+                r.metrics[6].samples.push_back(c.count[PERF_BRANCH_MISSES]);
+                r.metrics[7].samples.push_back(c.count[PERF_DTLB_MISSES]);
+                r.metrics[8].samples.push_back(c.dramBytes(counters->cacheLineSize()) * 1e-6);
+            }
+            ++r.runs;
+            fprintf(log, "@time of %s run:\t\t\t[%.3f] million cycles\n", variant, mcycles);
+
+            if (r.runs >= lo && bench_median_ci_rank(r.runs) > 0) {
+                BenchStats s = bench_stats(r.metrics[0].samples);
+                if (s.median > 0.0 && s.ci95 / s.median <= ciTarget) {
+                    r.converged = true;
+                    break;
+                }
+            }
+        }
+
+        if (ops > 0.0) {
+            BenchMetric perOp;
+            perOp.name = "usec_per_op";
+            for (size_t i = 0; i < r.metrics[1].samples.size(); ++i)
+                perOp.samples.push_back(r.metrics[1].samples[i] * 1e3 / ops);
+            r.metrics.push_back(perOp);
+        }
+        for (size_t m = 0; m < r.metrics.size(); ++m)
+            r.metrics[m].stats = bench_stats(r.metrics[m].samples);
+
+        const BenchStats &s = r.metrics[0].stats;
+        fprintf(log, "[%s %s]:\t\t[%.3f] million cycles (min %.3f, mean %.3f, stddev %.3f, %u runs%s)\n",
+                suite.c_str(), variant, s.median, s.min, s.mean, s.stddev, r.runs,
+                r.converged ? "" : ", not converged");
+        if (counters)
+            fprintf(log, "[%s %s]:\t\tIPC %.2f, L1D misses %.3g, LLC misses %.3g, "
+                    "branch misses %.3g, dTLB misses %.3g, ~%.1f MB from DRAM\n",
+                    suite.c_str(), variant, r.metrics[3].stats.median,
+                    r.metrics[4].stats.median, r.metrics[5].stats.median,
+                    r.metrics[6].stats.median, r.metrics[7].stats.median,
+                    r.metrics[8].stats.median);
+
+        results.push_back(r);
+        return r;
+    }
+
+    const BenchResult *result(const char *variant) const {
+        for (size_t i = 0; i < results.size(); ++i)
+            if (results[i].variant == variant)
+                return &results[i];
+        return NULL;
+    }
+
+    /* Median-based speedup of variant over base. */
+    double speedup(const char *base, const char *variant) const {
+        const BenchResult *b = result(base), *v = result(variant);
+        if (!b || !v || v->median() == 0.0) return 0.0;
+        return b->median() / v->median();
+    }
+
+    FILE *logFile() const { return log; }
+
+    /* Writes the machine readable report; called automatically on
+       destruction, and only once. */
+    void report() {
+        if (format == BENCH_FORMAT_TEXT || results.empty())
+            return;
+
+        FILE *fp = stdout;
+        if (!output.empty() && (fp = fopen(output.c_str(), "w")) == NULL) {
+            perror(output.c_str());
+            return;
+        }
+        if (format == BENCH_FORMAT_JSON)
+            writeJSON(fp);
+        else
+            writeCSV(fp);
+        if (fp != stdout)
+            fclose(fp);
+        results.clear();
+    }
+
+private:
+    static std::string escape(const std::string &s) {
+        std::string out;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '"' || s[i] == '\\')
+                out += '\\';
+            out += s[i];
+        }
+        return out;
+    }
+
+    void writeJSON(FILE *fp) const {
+        fprintf(fp, "{\n  \"benchmark\": \"%s\",\n  \"results\": [\n", escape(suite).c_str());
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult &r = results[i];
+            fprintf(fp, "    {\n      \"variant\": \"%s\",\n      \"warmup\": %u,\n"
+                    "      \"runs\": %u,\n      \"converged\": %s,\n      \"metrics\": {\n",
+                    escape(r.variant).c_str(), r.warmup, r.runs, r.converged ? "true" : "false");
+            for (size_t m = 0; m < r.metrics.size(); ++m) {
+                const BenchStats &s = r.metrics[m].stats;
+                fprintf(fp, "        \"%s\": { \"min\": %.6g, \"median\": %.6g, \"mean\": %.6g, "
+                        "\"stddev\": %.6g, \"ci95\": %.6g }%s\n",
+                        escape(r.metrics[m].name).c_str(), s.min, s.median, s.mean,
+                        s.stddev, s.ci95, m + 1 < r.metrics.size() ? "," : "");
+            }
+            fprintf(fp, "      }\n    }%s\n", i + 1 < results.size() ? "," : "");
+        }
+        fprintf(fp, "  ]\n}\n");
+    }
+
+    void writeCSV(FILE *fp) const {
+        fprintf(fp, "benchmark,variant,metric,warmup,runs,converged,min,median,mean,stddev,ci95\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult &r = results[i];
+            for (size_t m = 0; m < r.metrics.size(); ++m) {
+                const BenchStats &s = r.metrics[m].stats;
+                fprintf(fp, "%s,%s,%s,%u,%u,%d,%.6g,%.6g,%.6g,%.6g,%.6g\n",
+                        suite.c_str(), r.variant.c_str(), r.metrics[m].name.c_str(),
+                        r.warmup, r.runs, r.converged ? 1 : 0,
+                        s.min, s.median, s.mean, s.stddev, s.ci95);
+            }
+        }
+    }
+
+    std::string suite;
+    std::string output;
+    BenchFormat format;
+    unsigned int warmup, minRuns, maxRuns;
+    double ciTarget;
+    FILE *log;
+    bool noCounters;
+    PerfCounters *counters;
+    std::vector<BenchResult> results;
+};
+
+#endif // BENCH_H
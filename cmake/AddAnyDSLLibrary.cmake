@@ -0,0 +1,126 @@
+#
+# AddAnyDSLLibrary.cmake
+#
+# add_anydsl_library(NAME <library>
+#                    ANYDSL_IA_TARGETS <isa,isa,...>
+#                    CLANG_FLAGS <flags...>
+#                    IMPALA_FLAGS <flags...>
+#                    FILES <impala sources...>
+#                    ENTRY_POINTS <extern fns...>)
+#
+# Builds the shared library <library> from the Impala sources.  On x86 ELF
+# platforms the sources are compiled once per ISA in ANYDSL_IA_TARGETS
+# (sse4, avx2, avx512), each with targets/<isa>.impala providing the vector
+# width and a matching -march, mirroring what ISPC_IA_TARGETS does for the
+# ispc side.  The entry points of each variant are renamed to
+# <entry>_<isa> and a generated dispatcher (see anydsl_dispatch.h) binds
+# <entry> to the widest variant the host supports at load time.
+#
+# Elsewhere a single variant is built from targets/native.impala and the
+# CLANG_FLAGS as given.
+#
+# The sources are compiled with targets/uninstrumented.impala.  When
+# ISPC_INSTRUMENT is on, <library>_instrumented is built as well, with
+# targets/instrumented.impala, so that the lane statistics in util.impala
+# are reported; add_ispc_example() links it into <example>_instrumented.
+#
+function(add_anydsl_library)
+    set(oneValueArgs NAME)
+    set(multiValueArgs ANYDSL_IA_TARGETS CLANG_FLAGS IMPALA_FLAGS FILES ENTRY_POINTS)
+    cmake_parse_arguments("anydsl" "INSTRUMENTED" "${oneValueArgs}" "${multiValueArgs}" ${ARGN})
+
+    if (anydsl_INSTRUMENTED)
+        list(INSERT anydsl_FILES 0 ${EXAMPLES_ROOT}/targets/instrumented.impala)
+    else()
+        if (ISPC_INSTRUMENT)
+            add_anydsl_library(NAME ${anydsl_NAME}_instrumented
+                ANYDSL_IA_TARGETS ${anydsl_ANYDSL_IA_TARGETS}
+                CLANG_FLAGS ${anydsl_CLANG_FLAGS}
+                IMPALA_FLAGS ${anydsl_IMPALA_FLAGS}
+                FILES ${anydsl_FILES}
+                ENTRY_POINTS ${anydsl_ENTRY_POINTS}
+                INSTRUMENTED)
+        endif()
+        list(INSERT anydsl_FILES 0 ${EXAMPLES_ROOT}/targets/uninstrumented.impala)
+    endif()
+
+    # Code generation flags for the known targets
+    set(ANYDSL_sse4_FLAGS -march=nehalem)
+    set(ANYDSL_avx2_FLAGS -march=haswell)
+    set(ANYDSL_avx512_FLAGS -march=skylake-avx512)
+
+    set(MULTI_TARGET FALSE)
+    if (UNIX AND NOT APPLE AND CMAKE_OBJCOPY AND CMAKE_SYSTEM_PROCESSOR MATCHES "x86_64|AMD64|amd64|i.86")
+        set(MULTI_TARGET TRUE)
+    endif()
+
+    if (NOT MULTI_TARGET)
+        anydsl_runtime_wrap(ANYDSL_OUTPUT
+            NAME ${anydsl_NAME}
+            CLANG_FLAGS ${anydsl_CLANG_FLAGS}
+            IMPALA_FLAGS ${anydsl_IMPALA_FLAGS}
+            FILES ${EXAMPLES_ROOT}/targets/native.impala ${anydsl_FILES})
+        add_library(${anydsl_NAME} SHARED ${ANYDSL_OUTPUT})
+        return()
+    endif()
+
+    # The per-target -march replaces whatever the example asked for
+    set(CLANG_FLAGS ${anydsl_CLANG_FLAGS})
+    list(FILTER CLANG_FLAGS EXCLUDE REGEX "^-march=")
+
+    string(REPLACE "," ";" ANYDSL_TARGETS "${anydsl_ANYDSL_IA_TARGETS}")
+    set(LIBRARY_SOURCES)
+    set(DISPATCH_DEFINITIONS)
+    foreach (isa ${ANYDSL_TARGETS})
+        if (NOT DEFINED ANYDSL_${isa}_FLAGS)
+            message(FATAL_ERROR "Unknown AnyDSL target ${isa}")
+        endif()
+
+        set(ISA_OUTPUT)
+        anydsl_runtime_wrap(ISA_OUTPUT
+            NAME "${anydsl_NAME}_${isa}"
+            CLANG_FLAGS ${CLANG_FLAGS} ${ANYDSL_${isa}_FLAGS}
+            IMPALA_FLAGS ${anydsl_IMPALA_FLAGS}
+            FILES ${EXAMPLES_ROOT}/targets/${isa}.impala ${anydsl_FILES})
+
+        set(REDEFINE_SYMBOLS)
+        set(KEEP_SYMBOLS)
+        foreach (entry ${anydsl_ENTRY_POINTS})
+            list(APPEND REDEFINE_SYMBOLS --redefine-sym ${entry}=${entry}_${isa})
+            list(APPEND KEEP_SYMBOLS --keep-global-symbol=${entry}_${isa})
+        endforeach()
+
+        # Rename the entry points and make everything else local, so the
+        # variants can be linked into the same library.
+        foreach (output ${ISA_OUTPUT})
+            if (output MATCHES "\\.(o|obj)$")
+                get_filename_component(OUTPUT_NAME ${output} NAME_WE)
+                set(RENAMED "${CMAKE_CURRENT_BINARY_DIR}/${OUTPUT_NAME}_renamed.o")
+                add_custom_command(OUTPUT ${RENAMED}
+                    COMMAND ${CMAKE_OBJCOPY} ${REDEFINE_SYMBOLS} ${output} ${RENAMED}
+                    COMMAND ${CMAKE_OBJCOPY} ${KEEP_SYMBOLS} ${RENAMED}
+                    VERBATIM
+                    DEPENDS ${output})
+                list(APPEND LIBRARY_SOURCES ${RENAMED})
+            else()
+                list(APPEND LIBRARY_SOURCES ${output})
+            endif()
+        endforeach()
+
+        string(TOUPPER ${isa} ISA_UPPER)
+        list(APPEND DISPATCH_DEFINITIONS ANYDSL_HAVE_${ISA_UPPER})
+    endforeach()
+    list(REMOVE_DUPLICATES LIBRARY_SOURCES)
+
+    set(DISPATCH_SOURCE "${CMAKE_CURRENT_BINARY_DIR}/${anydsl_NAME}_dispatch.c")
+    set(DISPATCH_CONTENT "/* Generated by add_anydsl_library(); do not edit. */\n#include \"anydsl_dispatch.h\"\n\n")
+    foreach (entry ${anydsl_ENTRY_POINTS})
+        string(APPEND DISPATCH_CONTENT "ANYDSL_DISPATCH(${entry})\n")
+    endforeach()
+    file(GENERATE OUTPUT ${DISPATCH_SOURCE} CONTENT "${DISPATCH_CONTENT}")
+
+    add_library(${anydsl_NAME} SHARED ${LIBRARY_SOURCES} ${DISPATCH_SOURCE})
+    set_source_files_properties(${DISPATCH_SOURCE} PROPERTIES
+        COMPILE_DEFINITIONS "${DISPATCH_DEFINITIONS}")
+    target_include_directories(${anydsl_NAME} PRIVATE ${EXAMPLES_ROOT})
+endfunction()
@@ -33,10 +33,23 @@
 #
 # ispc ADDISPCTest.cmake
 #
+# With TASK_SYSTEMS, one executable <NAME>_<system> is built per listed task
+# system instead of a single <NAME>, all sharing one build of the ispc
+# sources.  Each entry X compiles tasksys.cpp with -DISPC_USE_X, unless
+# TASKSYS_X_SOURCES names a replacement implementation; TASKSYS_X_LIBRARIES
+# and TASKSYS_X_DEFINITIONS are added to that executable when set.
+#
+# With INSTRUMENTED, or for every example using the common settings when
+# ISPC_INSTRUMENT is on, an <NAME>_instrumented executable is built as well:
+# the ispc sources are compiled again with --instrument and linked with
+# instrument.cpp, which reports the lane utilization of each site at exit.
+# Libraries that have an instrumented variant (see add_anydsl_library())
+# are replaced by it there.
+#
 function(add_ispc_example)
-    set(options USE_COMMON_SETTINGS)
+    set(options USE_COMMON_SETTINGS INSTRUMENTED)
     set(oneValueArgs NAME ISPC_SRC_NAME DATA_DIR)
-    set(multiValueArgs ISPC_IA_TARGETS ISPC_ARM_TARGETS ISPC_FLAGS TARGET_SOURCES LIBRARIES DATA_FILES)
+    set(multiValueArgs ISPC_IA_TARGETS ISPC_ARM_TARGETS ISPC_FLAGS TARGET_SOURCES LIBRARIES DATA_FILES TASK_SYSTEMS)
     cmake_parse_arguments("example" "${options}" "${oneValueArgs}" "${multiValueArgs}" ${ARGN} )
 
     set(ISPC_KNOWN_TARGETS "sse2" "sse4" "avx1-" "avx1.1" "avx2" "avx512knl" "avx512skx")
@@ -98,41 +111,111 @@ function(add_ispc_example)
         VERBATIM
         DEPENDS "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
 
+    # Instrumented build of the ispc sources, into a subdirectory so that the
+    # driver finds the same header name there.
+    if (example_INSTRUMENTED OR (ISPC_INSTRUMENT AND example_USE_COMMON_SETTINGS))
+        set(ISPC_INSTRUMENT_DIR "${CMAKE_CURRENT_BINARY_DIR}/instrumented")
+        string(REPLACE "${CMAKE_CURRENT_BINARY_DIR}/" "${ISPC_INSTRUMENT_DIR}/"
+               ISPC_INSTRUMENT_OUTPUT "${ISPC_BUILD_OUTPUT}")
+        add_custom_command(OUTPUT ${ISPC_INSTRUMENT_OUTPUT}
+            COMMAND ${CMAKE_COMMAND} -E make_directory ${ISPC_INSTRUMENT_DIR}
+            COMMAND ${ISPC_EXECUTABLE} ${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc ${example_ISPC_FLAGS} --instrument --target=${ISPC_TARGETS} --arch=${ISPC_ARCH} --pic
+                                        -h ${ISPC_INSTRUMENT_DIR}/${ISPC_SRC_NAME}_ispc.h -o ${ISPC_INSTRUMENT_DIR}/${ISPC_SRC_NAME}_ispc${CMAKE_CXX_OUTPUT_EXTENSION}
+            VERBATIM
+            DEPENDS "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
+    endif()
+
     # To show ispc source in VS solution:
     if (WIN32)
         set_source_files_properties("${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc" PROPERTIES HEADER_FILE_ONLY TRUE)
     endif()
 
-    add_executable(${example_NAME} ${ISPC_BUILD_OUTPUT} "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
-    target_sources(${example_NAME} PRIVATE ${example_TARGET_SOURCES})
-    target_include_directories(${example_NAME} PRIVATE ${CMAKE_CURRENT_BINARY_DIR})
-    # Compile options
-    if (UNIX)
-        if (${ARCH_BIT} EQUAL 32)
-            target_compile_options(${example_NAME} PRIVATE -m32)
-        else()
-            target_compile_options(${example_NAME} PRIVATE -m64)
-        endif()
+    if (example_TASK_SYSTEMS)
+        # The ispc objects go into a library shared by the per task system
+        # executables, so that the ispc command is attached to one target only.
+        set(ISPC_LIBRARY_NAME "${example_NAME}_ispc")
+        add_library(${ISPC_LIBRARY_NAME} STATIC ${ISPC_BUILD_OUTPUT})
+        set_target_properties(${ISPC_LIBRARY_NAME} PROPERTIES LINKER_LANGUAGE CXX FOLDER "Examples")
+        set(EXAMPLE_TARGETS)
+        foreach (task_system ${example_TASK_SYSTEMS})
+            string(TOLOWER ${task_system} task_system_name)
+            set(target_name "${example_NAME}_${task_system_name}")
+            add_executable(${target_name} "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
+            add_dependencies(${target_name} ${ISPC_LIBRARY_NAME})
+            target_link_libraries(${target_name} ${ISPC_LIBRARY_NAME})
+            if (TASKSYS_${task_system}_SOURCES)
+                target_sources(${target_name} PRIVATE ${TASKSYS_${task_system}_SOURCES})
+            else()
+                target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/tasksys.cpp)
+                target_compile_definitions(${target_name} PRIVATE ISPC_USE_${task_system})
+            endif()
+            if (TASKSYS_${task_system}_DEFINITIONS)
+                target_compile_definitions(${target_name} PRIVATE ${TASKSYS_${task_system}_DEFINITIONS})
+            endif()
+            if (TASKSYS_${task_system}_LIBRARIES)
+                target_link_libraries(${target_name} ${TASKSYS_${task_system}_LIBRARIES})
+            endif()
+            list(APPEND EXAMPLE_TARGETS ${target_name})
+        endforeach()
     else()
-        target_compile_options(${example_NAME} PRIVATE /fp:fast /Oi)
+        add_executable(${example_NAME} ${ISPC_BUILD_OUTPUT} "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
+        if (example_USE_COMMON_SETTINGS)
+            target_sources(${example_NAME} PRIVATE ${EXAMPLES_ROOT}/tasksys.cpp)
+        endif()
+        set(EXAMPLE_TARGETS ${example_NAME})
     endif()
 
-    # Common settings
-    if (example_USE_COMMON_SETTINGS)
-        target_sources(${example_NAME} PRIVATE ${EXAMPLES_ROOT}/tasksys.cpp)
-        target_sources(${example_NAME} PRIVATE ${EXAMPLES_ROOT}/timing.h)
-        if (UNIX)
-            target_compile_options(${example_NAME} PRIVATE -O2)
-            target_link_libraries(${example_NAME} pthread m stdc++)
+    if (ISPC_INSTRUMENT_DIR)
+        set(target_name "${example_NAME}_instrumented")
+        add_executable(${target_name} ${ISPC_INSTRUMENT_OUTPUT} "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
+        target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/instrument.cpp ${EXAMPLES_ROOT}/instrument.h)
+        target_include_directories(${target_name} PRIVATE ${ISPC_INSTRUMENT_DIR})
+        if (example_USE_COMMON_SETTINGS)
+            target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/tasksys.cpp)
         endif()
+        list(APPEND EXAMPLE_TARGETS ${target_name})
     endif()
 
-    # Link libraries
-    if (example_LIBRARIES)
-        target_link_libraries(${example_NAME} ${example_LIBRARIES})
-    endif()
+    foreach (target_name ${EXAMPLE_TARGETS})
+        target_sources(${target_name} PRIVATE ${example_TARGET_SOURCES})
+        target_include_directories(${target_name} PRIVATE ${CMAKE_CURRENT_BINARY_DIR})
+        # Compile options
+        if (UNIX)
+            if (${ARCH_BIT} EQUAL 32)
+                target_compile_options(${target_name} PRIVATE -m32)
+            else()
+                target_compile_options(${target_name} PRIVATE -m64)
+            endif()
+        else()
+            target_compile_options(${target_name} PRIVATE /fp:fast /Oi)
+        endif()
+
+        # Common settings
+        if (example_USE_COMMON_SETTINGS)
+            if (ISPC_TASKSYS_TRACE)
+                target_compile_definitions(${target_name} PRIVATE ISPC_TASKSYS_TRACE)
+            endif()
+            target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/timing.h)
+            target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/bench.h)
+            target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/perfcounters.h)
+            target_sources(${target_name} PRIVATE ${EXAMPLES_ROOT}/numa.h)
+            if (UNIX)
+                target_compile_options(${target_name} PRIVATE -O2)
+                target_link_libraries(${target_name} pthread m stdc++)
+            endif()
+        endif()
+
+        # Link libraries
+        foreach (library ${example_LIBRARIES})
+            if (target_name STREQUAL "${example_NAME}_instrumented" AND TARGET ${library}_instrumented)
+                target_link_libraries(${target_name} ${library}_instrumented)
+            else()
+                target_link_libraries(${target_name} ${library})
+            endif()
+        endforeach()
 
-    set_target_properties(${example_NAME} PROPERTIES FOLDER "Examples")
+        set_target_properties(${target_name} PROPERTIES FOLDER "Examples")
+    endforeach()
     if(MSVC)
         # Group ISPC files inside Visual Studio
         source_group("ISPC" FILES "${CMAKE_CURRENT_SOURCE_DIR}/${ISPC_SRC_NAME}.ispc")
@@ -141,7 +224,7 @@ function(add_ispc_example)
     # Install example
     # We do not need to include examples binaries to the package
     if (NOT ISPC_PREPARE_PACKAGE)
-        install(TARGETS ${example_NAME} RUNTIME DESTINATION examples/${example_NAME})
+        install(TARGETS ${EXAMPLE_TARGETS} RUNTIME DESTINATION examples/${example_NAME})
         if (example_DATA_FILES)
             install(FILES ${example_DATA_FILES}
                     DESTINATION examples/${example_NAME})
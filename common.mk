@@ -9,8 +9,20 @@ CC=clang
 CCFLAGS+=-Iobjs/ -O2
 
 LIBS=-lm $(TASK_LIB) -lstdc++
+
+# make TASKSYS_TRACE=1 builds tasksys.cpp with ISPC_TASKSYS_TRACE
+ifeq ($(TASKSYS_TRACE),1)
+  CXXFLAGS+=-DISPC_TASKSYS_TRACE
+endif
 ISPC=ispc
 ISPC_FLAGS+=-O2
+
+# make INSTRUMENT=1 compiles the ispc code with --instrument and links
+# instrument.cpp, which reports the SIMD lane utilization per site at exit
+ifeq ($(INSTRUMENT),1)
+  ISPC_FLAGS+=--instrument
+  INSTRUMENT_OBJ=objs/instrument.o
+endif
 ISPC_HEADER=objs/$(ISPC_SRC:.ispc=_ispc.h)
 
 ARCH:=$(shell uname -m | sed -e s/x86_64/x86/ -e s/i686/x86/ -e s/arm.*/arm/ -e s/sa110/arm/)
@@ -62,7 +74,7 @@ endif
 
 CPP_OBJS=$(addprefix objs/, $(CPP_SRC:.cpp=.o))
 CC_OBJS=$(addprefix objs/, $(CC_SRC:.c=.o))
-OBJS=$(CPP_OBJS) $(CC_OBJS) $(TASK_OBJ) $(ISPC_OBJS)
+OBJS=$(CPP_OBJS) $(CC_OBJS) $(TASK_OBJ) $(INSTRUMENT_OBJ) $(ISPC_OBJS)
 
 default: $(EXAMPLE)
 
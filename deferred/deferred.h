@@ -99,9 +99,9 @@ void DeleteInputData(InputData *input);
 void WriteFrame(const char *filename, const InputData *input,
                 const Framebuffer &framebuffer);
 void InitDynamicC(InputData *input);
-void InitDynamicCilk(InputData *input);
+void InitDynamicTasks(InputData *input);
 void DispatchDynamicC(InputData *input, Framebuffer *framebuffer);
-void DispatchDynamicCilk(InputData *input, Framebuffer *framebuffer);
+void DispatchDynamicTasks(InputData *input, Framebuffer *framebuffer);
 
 #endif // !ISPC
 
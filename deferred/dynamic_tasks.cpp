@@ -31,11 +31,19 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#ifdef __cilk
+/*
+  Dynamic tile subdivision, run in parallel: the root tiles are shaded as
+  one launch, and every tile that is split recurses into its four subtiles
+  as a nested launch.  This relies on the task system running waiting
+  tasks in ISPCSync(), which all of those in ../tasksys.cpp do, so the
+  recursion keeps every core busy without blocking any of them.  When
+  compiled with Cilk Plus, _Cilk_for/_Cilk_spawn are used instead.
+*/
 
 #include "deferred.h"
 #include "kernels_ispc.h"
 #include <algorithm>
+#include <functional>
 #include <assert.h>
 
 #ifdef _MSC_VER
@@ -50,6 +58,34 @@
 #include <malloc.h>
 #endif // ISPC_IS_LINUX
 
+#ifndef __cilk
+extern "C" {
+    void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
+    void ISPCSync(void *handle);
+}
+
+static void
+lParallelForTask(void *data, int threadIndex, int threadCount,
+                 int taskIndex, int taskCount,
+                 int taskIndex0, int taskIndex1, int taskIndex2,
+                 int taskCount0, int taskCount1, int taskCount2) {
+    (*(const std::function<void(int)> *)data)(taskIndex);
+}
+#endif // !__cilk
+
+// Calls body(i) for i in [0, count) in parallel and returns once all are done
+static void
+lParallelFor(int count, const std::function<void(int)> &body) {
+#ifdef __cilk
+    _Cilk_for (int i = 0; i < count; ++i)
+        body(i);
+#else
+    void *handle = NULL;
+    ISPCLaunch(&handle, (void *)lParallelForTask, (void *)&body, count, 1, 1);
+    ISPCSync(handle);
+#endif // __cilk
+}
+
 // Currently tile widths must be a multiple of SIMD width (i.e. 8 for ispc sse4x2)!
 #define MIN_TILE_WIDTH 16
 #define MIN_TILE_HEIGHT 16
@@ -92,12 +128,12 @@ lAlignedFree(void *ptr) {
 }
 
 
-class MinMaxZTreeCilk
+class MinMaxZTreeTasks
 {
 public:
     // Currently (min) tile dimensions must divide gBuffer dimensions evenly
     // Levels must be small enough that neither dimension goes below one tile
-    MinMaxZTreeCilk(
+    MinMaxZTreeTasks(
         int tileWidth, int tileHeight, int levels,
         int gBufferWidth, int gBufferHeight)
         : mTileWidth(tileWidth), mTileHeight(tileHeight), mLevels(levels)
@@ -126,15 +162,15 @@ public:
         float cameraProj_33, float cameraProj_43,
         float cameraNear, float cameraFar)
     {
-        // Compute level 0 in parallel. Outer loops is here since we use Cilk
-        _Cilk_for (int tileY = 0; tileY < mNumTilesY; ++tileY) {
+        // Compute level 0 in parallel, one task per row of tiles
+        lParallelFor(mNumTilesY, [&](int tileY) {
             ispc::ComputeZBoundsRow(tileY,
                 mTileWidth, mTileHeight, mNumTilesX, mNumTilesY,
                 zBuffer, gBufferPitchInElements,
                 cameraProj_33, cameraProj_43, cameraNear, cameraFar,
                 mMinZArrays[0] + (tileY * mNumTilesX),
                 mMaxZArrays[0] + (tileY * mNumTilesX));
-        }
+        });
 
         // Generate other levels
         // NOTE: We currently don't use ispc here since it's sort of an
@@ -146,7 +182,7 @@ public:
             int srcLevel = level - 1;
             int srcTilesX = NumTilesX(srcLevel);
             int srcTilesY = NumTilesY(srcLevel);
-            _Cilk_for (int y = 0; y < destTilesY; ++y) {
+            lParallelFor(destTilesY, [&](int y) {
                 for (int x = 0; x < destTilesX; ++x) {
                     int srcX = x << 1;
                     int srcY = y << 1;
@@ -175,11 +211,11 @@ public:
                     mMinZArrays[level][y * destTilesX + x] = minZ;
                     mMaxZArrays[level][y * destTilesX + x] = maxZ;
                 }
-            }
+            });
         }
     }
 
-    ~MinMaxZTreeCilk() {
+    ~MinMaxZTreeTasks() {
         for (int i = 0; i < mLevels; ++i) {
             lAlignedFree(mMinZArrays[i]);
             lAlignedFree(mMaxZArrays[i]);
@@ -216,11 +252,11 @@ private:
     float **mMaxZArrays;
 };
 
-static MinMaxZTreeCilk *gMinMaxZTreeCilk = 0;
+static MinMaxZTreeTasks *gMinMaxZTreeTasks = 0;
 
-void InitDynamicCilk(InputData *input) {
-    gMinMaxZTreeCilk =
-        new MinMaxZTreeCilk(MIN_TILE_WIDTH, MIN_TILE_HEIGHT, DYNAMIC_TREE_LEVELS,
+void InitDynamicTasks(InputData *input) {
+    gMinMaxZTreeTasks =
+        new MinMaxZTreeTasks(MIN_TILE_WIDTH, MIN_TILE_HEIGHT, DYNAMIC_TREE_LEVELS,
                             input->header.framebufferWidth,
                             input->header.framebufferHeight);
 }
@@ -230,7 +266,7 @@ static void
 ShadeDynamicTileRecurse(InputData *input, int level, int tileX, int tileY,
                         int *lightIndices, int numLights,
                         Framebuffer *framebuffer) {
-    const MinMaxZTreeCilk *minMaxZTree = gMinMaxZTreeCilk;
+    const MinMaxZTreeTasks *minMaxZTree = gMinMaxZTreeTasks;
 
     // If we few enough lights or this is the base case (last level), shade
     // this full tile directly
@@ -314,7 +350,8 @@ ShadeDynamicTileRecurse(InputData *input, int level, int tileX, int tileY,
             input->arrays.lightAttenuationEnd,
             subtileLightIndices[0], MAX_LIGHTS, subtileNumLights);
 
-        // Recurse into subtiles
+        // Recurse into subtiles (00, 10, 01, 11)
+#ifdef __cilk
         _Cilk_spawn ShadeDynamicTileRecurse(input, level, tileX    , tileY,
                                             subtileLightIndices[0], subtileNumLights[0],
                                             framebuffer);
@@ -327,6 +364,13 @@ ShadeDynamicTileRecurse(InputData *input, int level, int tileX, int tileY,
         ShadeDynamicTileRecurse(input, level, tileX + 1, tileY + 1,
                                 subtileLightIndices[3], subtileNumLights[3],
                                 framebuffer);
+#else
+        lParallelFor(4, [&](int i) {
+            ShadeDynamicTileRecurse(input, level, tileX + (i & 1), tileY + (i >> 1),
+                                    subtileLightIndices[i], subtileNumLights[i],
+                                    framebuffer);
+        });
+#endif // __cilk
     }
 }
 
@@ -334,7 +378,7 @@ ShadeDynamicTileRecurse(InputData *input, int level, int tileX, int tileY,
 static void
 ShadeDynamicTile(InputData *input, int level, int tileX, int tileY,
                  Framebuffer *framebuffer) {
-    const MinMaxZTreeCilk *minMaxZTree = gMinMaxZTreeCilk;
+    const MinMaxZTreeTasks *minMaxZTree = gMinMaxZTreeTasks;
 
     // Get Z min/max for this tile
     int width = minMaxZTree->TileWidth(level);
@@ -371,9 +415,9 @@ ShadeDynamicTile(InputData *input, int level, int tileX, int tileY,
 
 
 void
-DispatchDynamicCilk(InputData *input, Framebuffer *framebuffer)
+DispatchDynamicTasks(InputData *input, Framebuffer *framebuffer)
 {
-    MinMaxZTreeCilk *minMaxZTree = gMinMaxZTreeCilk;
+    MinMaxZTreeTasks *minMaxZTree = gMinMaxZTreeTasks;
 
     // Update min/max Z tree
     minMaxZTree->Update(input->arrays.zBuffer, input->header.framebufferWidth,
@@ -388,11 +432,9 @@ DispatchDynamicCilk(InputData *input, Framebuffer *framebuffer)
     int rootTilesX = minMaxZTree->NumTilesX(rootLevel);
     int rootTilesY = minMaxZTree->NumTilesY(rootLevel);
     int rootTiles = rootTilesX * rootTilesY;
-    _Cilk_for (int g = 0; g < rootTiles; ++g) {
+    lParallelFor(rootTiles, [&](int g) {
         uint32_t tileY = g / rootTilesX;
         uint32_t tileX = g % rootTilesX;
         ShadeDynamicTile(input, rootLevel, tileX, tileY, framebuffer);
-    }
+    });
 }
-
-#endif // __cilk
@@ -59,6 +59,16 @@
 #include "kernels_ispc.h"
 #include "../timing.h"
 
+// deferred.impala
+extern "C" void deferred_impala(const ispc::InputHeader &inputHeader,
+                                const ispc::InputDataArrays &inputData,
+                                int visualizeLightCount, uint8_t framebuffer_r[],
+                                uint8_t framebuffer_g[], uint8_t framebuffer_b[]);
+extern "C" void deferred_impala_tasks(const ispc::InputHeader &inputHeader,
+                                      const ispc::InputDataArrays &inputData,
+                                      int visualizeLightCount, uint8_t framebuffer_r[],
+                                      uint8_t framebuffer_g[], uint8_t framebuffer_b[]);
+
 ///////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv) {
@@ -83,9 +93,7 @@ int main(int argc, char** argv) {
                             input->header.framebufferHeight);
 
     InitDynamicC(input);
-#ifdef __cilk
-    InitDynamicCilk(input);
-#endif // __cilk
+    InitDynamicTasks(input);
 
     int nframes = test_iterations[2];
     double ispcCycles = 1e30;
@@ -105,22 +113,42 @@ int main(int argc, char** argv) {
            input->header.framebufferWidth, input->header.framebufferHeight);
     WriteFrame("deferred-ispc-static.ppm", input, framebuffer);
 
+    double impalaTasksCycles = 1e30;
+    for (unsigned int i = 0; i < test_iterations[0]; ++i) {
+        framebuffer.clear();
+        reset_and_start_timer();
+        for (int j = 0; j < nframes; ++j)
+            deferred_impala_tasks(input->header, input->arrays,
+                                  VISUALIZE_LIGHT_COUNT,
+                                  framebuffer.r, framebuffer.g, framebuffer.b);
+        double mcycles = get_elapsed_mcycles() / nframes;
+        printf("@time of AnyDSL + TASKS run:\t\t[%.3f] million cycles\n", mcycles);
+        impalaTasksCycles = std::min(impalaTasksCycles, mcycles);
+    }
+    printf("[impala static + tasks]:\t[%.3f] million cycles to render "
+           "%d x %d image\n", impalaTasksCycles,
+           input->header.framebufferWidth, input->header.framebufferHeight);
+    WriteFrame("deferred-impala.ppm", input, framebuffer);
+
     nframes = 3;
-#ifdef __cilk
-    double dynamicCilkCycles = 1e30;
-    for (int i = 0; i < test_iterations[1]; ++i) {
+    double dynamicCycles = 1e30;
+    for (unsigned int i = 0; i < test_iterations[1]; ++i) {
         framebuffer.clear();
         reset_and_start_timer();
         for (int j = 0; j < nframes; ++j)
-            DispatchDynamicCilk(input, &framebuffer);
+            DispatchDynamicTasks(input, &framebuffer);
         double mcycles = get_elapsed_mcycles() / nframes;
-        printf("@time of serial run:\t\t\t[%.3f] million cycles\n", mcycles);
-        dynamicCilkCycles = std::min(dynamicCilkCycles, mcycles);
+        printf("@time of ISPC + dynamic TASKS run:\t[%.3f] million cycles\n", mcycles);
+        dynamicCycles = std::min(dynamicCycles, mcycles);
     }
+#ifdef __cilk
     printf("[ispc + Cilk dynamic]:\t\t[%.3f] million cycles to render image\n",
-           dynamicCilkCycles);
-    WriteFrame("deferred-ispc-dynamic.ppm", input, framebuffer);
+           dynamicCycles);
+#else
+    printf("[ispc + tasks dynamic]:\t\t[%.3f] million cycles to render image\n",
+           dynamicCycles);
 #endif // __cilk
+    WriteFrame("deferred-ispc-dynamic.ppm", input, framebuffer);
 
     double serialCycles = 1e30;
     for (unsigned int i = 0; i < test_iterations[1]; ++i) {
@@ -136,12 +164,24 @@ int main(int argc, char** argv) {
            serialCycles);
     WriteFrame("deferred-serial-dynamic.ppm", input, framebuffer);
 
-#ifdef __cilk
-    printf("\t\t\t\t(%.2fx speedup from static ISPC, %.2fx from Cilk+ISPC)\n",
-           serialCycles/ispcCycles, serialCycles/dynamicCilkCycles);
-#else
-    printf("\t\t\t\t(%.2fx speedup from ISPC + tasks)\n", serialCycles/ispcCycles);
-#endif // __cilk
+    double impalaCycles = 1e30;
+    for (unsigned int i = 0; i < test_iterations[1]; ++i) {
+        framebuffer.clear();
+        reset_and_start_timer();
+        for (int j = 0; j < nframes; ++j)
+            deferred_impala(input->header, input->arrays, VISUALIZE_LIGHT_COUNT,
+                            framebuffer.r, framebuffer.g, framebuffer.b);
+        double mcycles = get_elapsed_mcycles() / nframes;
+        printf("@time of AnyDSL run:\t\t\t[%.3f] million cycles\n", mcycles);
+        impalaCycles = std::min(impalaCycles, mcycles);
+    }
+    printf("[impala static, 1 core]:\t[%.3f] million cycles to render image\n",
+           impalaCycles);
+
+    printf("\t\t\t\t(%.2fx speedup from static ISPC, %.2fx from dynamic ISPC)\n",
+           serialCycles/ispcCycles, serialCycles/dynamicCycles);
+    printf("\t\t\t\t(%.2fx speedup from static AnyDSL, %.2fx from static AnyDSL + tasks)\n",
+           serialCycles/impalaCycles, serialCycles/impalaTasksCycles);
 
     DeleteInputData(input);
 
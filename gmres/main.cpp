@@ -76,5 +76,6 @@ int main (int argc, char **argv)
     DEBUG_PRINT("residual error check: %lg\n", resid.norm() / b->norm());
 #endif
     // Print profiling results
-    DEBUG_PRINT("-- Total mcycles to solve : %.03f --\n", gmres_cycles);
+    DEBUG_PRINT("-- Total mcycles to solve (%s kernels) : %.03f --\n",
+                KERNEL_BACKEND, gmres_cycles);
 }
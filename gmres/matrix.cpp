@@ -39,7 +39,6 @@
 | Includes
 \**************************************************************/
 #include "matrix.h"
-#include "matrix_ispc.h"
 
 extern "C" {
 #include "mmio.h"
@@ -226,6 +225,12 @@ void CRSMatrix::multiply (const Vector &v, Vector &r) const
     ASSERT(v.size() == cols());
     ASSERT(r.size() == rows());
 
+#ifdef GMRES_USE_IMPALA
+    sparse_multiply_impala(&entries[0], &columns[0], &row_offsets[0],
+                           rows(), cols(), _nonzeroes, &v[0], &r[0]);
+#else
+    // matrix.ispc's sparse_multiply takes the column and row offset arrays
+    // as doubles, so the ispc build keeps this loop.
     for (size_t row = 0; row < rows(); row++)
     {
         int row_offset = row_offsets[row];
@@ -238,6 +243,7 @@ void CRSMatrix::multiply (const Vector &v, Vector &r) const
         }
         r[row] = sum;
     }
+#endif
 }
 
 void CRSMatrix::zero ( )
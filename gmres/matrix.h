@@ -44,7 +44,33 @@
 #include <vector>
 
 #include "debug.h"
+
+/**************************************************************\
+| Kernel backend
+\**************************************************************/
+// The vector and matrix kernels come from matrix.ispc by default, or from
+// matrix.impala when GMRES_USE_IMPALA is defined (the gmres_impala
+// target); KERNEL(name) names the selected implementation.
+#ifdef GMRES_USE_IMPALA
+extern "C" {
+void   zero_impala (double data[], int size);
+void   vector_add_impala (double a[], const double b[], int size);
+void   vector_sub_impala (double a[], const double b[], int size);
+void   vector_mult_impala (double a[], double b, int size);
+void   vector_div_impala (double a[], double b, int size);
+void   vector_add_ax_impala (double r[], double a, const double x[], int size);
+double vector_dot_impala (const double a[], const double b[], int size);
+void   sparse_multiply_impala (const double entries[], const int columns[],
+                               const int row_offsets[], int rows, int cols,
+                               int nonzeroes, const double v[], double r[]);
+}
+#define KERNEL(name) name##_impala
+#define KERNEL_BACKEND "impala"
+#else
 #include "matrix_ispc.h"
+#define KERNEL(name) ispc::name
+#define KERNEL_BACKEND "ispc"
+#endif
 
 
 class DenseMatrix;
@@ -114,17 +140,17 @@ class Vector {
     double dot (const Vector &b) const
     {
         ASSERT(b.size() == this->size());
-        return ispc::vector_dot(entries, b.entries, size());
+        return KERNEL(vector_dot)(entries, b.entries, size());
     }
 
     double dot (const double * const b) const
     {
-        return ispc::vector_dot(entries, b, size());
+        return KERNEL(vector_dot)(entries, b, size());
     }
 
     void zero ()
     {
-        ispc::zero(entries, size());
+        KERNEL(zero)(entries, size());
     }
 
     double norm () const { return sqrt(dot(entries)); }
@@ -134,29 +160,29 @@ class Vector {
     void add (const Vector &a)
     {
         ASSERT(size() == a.size());
-        ispc::vector_add(entries, a.entries, size());
+        KERNEL(vector_add)(entries, a.entries, size());
     }
 
     void subtract (const Vector &s)
     {
         ASSERT(size() == s.size());
-        ispc::vector_sub(entries, s.entries, size());
+        KERNEL(vector_sub)(entries, s.entries, size());
     }
 
     void multiply (double scalar)
     {
-        ispc::vector_mult(entries, scalar, size());
+        KERNEL(vector_mult)(entries, scalar, size());
     }
 
     void divide (double scalar)
     {
-        ispc::vector_div(entries, scalar, size());
+        KERNEL(vector_div)(entries, scalar, size());
     }
 
     // Note: x may be longer than *(this)
     void add_ax (double a, const Vector &x) {
         ASSERT(x.size() >= size());
-        ispc::vector_add_ax(entries, a, x.entries, size());
+        KERNEL(vector_add_ax)(entries, a, x.entries, size());
     }
 
     // Note that copy only copies the first size() elements of the
@@ -235,7 +261,7 @@ class DenseMatrix : public Matrix {
     void          row(size_t row, Vector &r);
     void      set_row(size_t row, const Vector &v);
 
-    virtual void zero() { ispc::zero(entries, rows() * cols()); }
+    virtual void zero() { KERNEL(zero)(entries, rows() * cols()); }
 
     void copy (const DenseMatrix &other)
     {
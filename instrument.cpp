@@ -0,0 +1,222 @@
+/*
+  ISPCInstrument() implementation that gathers per-site lane utilization;
+  see instrument.h.  The instrumented Impala code (util.impala) reports
+  through anydsl_instrument() into the same tables.
+
+  Every thread counts into its own table, keyed by the string pointers and
+  line ispc passes, so the callback takes no lock and touches no shared
+  cache lines.  The tables are merged by site name when the report is
+  printed; a site compiled into several targets of a multi-target build
+  then shows up once.  ISPCPrintInstrument() reads the tables without
+  synchronization, so it should be called when no ispc code is running,
+  as it is at exit.
+*/
+
+#include "instrument.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define MAX_LANES 64
+#define DEFAULT_TOP_SITES 40
+
+struct SiteKey {
+    const char *fn, *note;
+    int line;
+
+    bool operator==(const SiteKey &k) const {
+        return fn == k.fn && note == k.note && line == k.line;
+    }
+};
+
+struct SiteKeyHash {
+    size_t operator()(const SiteKey &k) const {
+        size_t h = (size_t)k.fn * 31 + (size_t)k.note;
+        return (h ^ (h >> 15)) * 0x9e3779b97f4a7c15ull + (size_t)k.line;
+    }
+};
+
+struct SiteStats {
+    SiteStats() : width(0), calls(0), changes(0), lastMask(0) {
+        memset(lanes, 0, sizeof(lanes));
+    }
+
+    void Add(const SiteStats &s) {
+        width = std::max(width, s.width);
+        calls += s.calls;
+        changes += s.changes;
+        for (int i = 0; i <= MAX_LANES; ++i)
+            lanes[i] += s.lanes[i];
+    }
+
+    int width;                   // vector width, or 0 for the ispc gang width
+    uint64_t calls;
+    uint64_t changes;            // calls whose mask differed from the last one
+    uint64_t lanes[MAX_LANES + 1]; // calls by number of active lanes
+    uint64_t lastMask;
+};
+
+struct ThreadTable {
+    ThreadTable() : maskBits(0) {}
+
+    std::unordered_map<SiteKey, SiteStats, SiteKeyHash> sites;
+    uint64_t maskBits;           // union of all ispc masks seen
+};
+
+// Allocated on first use and never freed, so that instrumented code that
+// runs in static constructors or destructors still finds it.
+static std::mutex lTablesMutex;
+static std::vector<ThreadTable *> *lTables = NULL;
+static thread_local ThreadTable *lTable = NULL;
+
+static void lPrintAtExit() { ISPCPrintInstrument(); }
+
+static ThreadTable *
+lRegisterThread() {
+    ThreadTable *table = new ThreadTable;
+    std::lock_guard<std::mutex> lock(lTablesMutex);
+    if (lTables == NULL) {
+        lTables = new std::vector<ThreadTable *>;
+        atexit(lPrintAtExit);
+    }
+    lTables->push_back(table);
+    return table;
+}
+
+static inline void
+lRecord(const char *fn, const char *note, int line, uint64_t mask, int width, int count) {
+    ThreadTable *table = lTable;
+    if (table == NULL)
+        table = lTable = lRegisterThread();
+
+    SiteKey key = { fn, note, line };
+    SiteStats &s = table->sites[key];
+    if (s.calls > 0 && mask != s.lastMask)
+        ++s.changes;
+    s.lastMask = mask;
+    s.width = width;
+    s.calls += count;
+    s.lanes[__builtin_popcountll(mask)] += count;
+    if (width == 0)
+        table->maskBits |= mask;
+}
+
+void
+ISPCInstrument(const char *fn, const char *note, int line, uint64_t mask) {
+    lRecord(fn, note, line, mask, 0, 1);
+}
+
+void
+anydsl_instrument(const char *site, const char *note, int32_t mask, int32_t width, int32_t count) {
+    lRecord(site, note, 0, (uint32_t)mask, width, count);
+}
+
+struct SiteReport {
+    std::string name;
+    SiteStats stats;
+    int width;
+    uint64_t activeLanes, idleLanes;
+};
+
+void
+ISPCPrintInstrument() {
+    // Merge the per-thread tables by site name.
+    std::unordered_map<std::string, SiteStats> merged;
+    uint64_t maskBits = 0;
+    {
+        std::lock_guard<std::mutex> lock(lTablesMutex);
+        for (size_t t = 0; lTables != NULL && t < lTables->size(); ++t) {
+            ThreadTable *table = (*lTables)[t];
+            maskBits |= table->maskBits;
+            for (auto &site : table->sites) {
+                // ispc passes file and line, Impala a site name
+                char line[16] = " ";
+                if (site.first.line > 0)
+                    snprintf(line, sizeof(line), ":%d ", site.first.line);
+                std::string name = std::string(site.first.fn) + line + site.first.note;
+                merged[name].Add(site.second);
+            }
+        }
+    }
+    if (merged.empty())
+        return;
+
+    int gangWidth = 64 - __builtin_clzll(maskBits | 1);
+    const char *env = getenv("ISPC_INSTRUMENT_WIDTH");
+    if (env != NULL && atoi(env) > 0)
+        gangWidth = std::min(atoi(env), MAX_LANES);
+    int top = DEFAULT_TOP_SITES;
+    env = getenv("ISPC_INSTRUMENT_TOP");
+    if (env != NULL && atoi(env) > 0)
+        top = atoi(env);
+
+    std::vector<SiteReport> sites;
+    uint64_t totalCalls = 0, totalSlots = 0, totalActive = 0;
+    for (auto &site : merged) {
+        SiteReport r;
+        r.name = site.first;
+        r.stats = site.second;
+        r.width = r.stats.width > 0 ? r.stats.width : gangWidth;
+        r.activeLanes = 0;
+        for (int i = 0; i <= MAX_LANES; ++i)
+            r.activeLanes += (uint64_t)i * r.stats.lanes[i];
+        uint64_t slots = r.stats.calls * r.width;
+        r.idleLanes = slots - std::min(r.activeLanes, slots);
+        totalCalls += r.stats.calls;
+        totalSlots += slots;
+        totalActive += r.activeLanes;
+        sites.push_back(r);
+    }
+    std::sort(sites.begin(), sites.end(), [](const SiteReport &a, const SiteReport &b) {
+        return a.idleLanes != b.idleLanes ? a.idleLanes > b.idleLanes : a.name < b.name;
+    });
+
+    FILE *out = stderr;
+    const char *path = getenv("ISPC_INSTRUMENT");
+    if (path != NULL && *path != '\0' && (out = fopen(path, "w")) == NULL) {
+        perror(path);
+        out = stderr;
+    }
+
+    fprintf(out, "lane instrumentation: %d sites, %llu calls, %.1f%% of lane slots active\n",
+            (int)sites.size(), (unsigned long long)totalCalls,
+            100. * totalActive / std::max((double)totalSlots, 1.));
+    fprintf(out, "%12s %9s %7s %7s %7s %8s %6s  %s\n", "calls", "avg lanes", "all on",
+            "mixed", "all off", "changed", "idle", "site (sorted by idle lane slots)");
+    for (int i = 0; i < (int)sites.size() && i < top; ++i) {
+        const SiteReport &r = sites[i];
+        double calls = (double)r.stats.calls;
+        uint64_t allOn = 0;
+        for (int l = r.width; l <= MAX_LANES; ++l)
+            allOn += r.stats.lanes[l];
+        uint64_t allOff = r.stats.lanes[0];
+        uint64_t mixed = r.stats.calls - allOn - allOff;
+        fprintf(out, "%12llu %6.2f/%-2d %6.1f%% %6.1f%% %6.1f%% %7.1f%% %5.1f%%  %s\n",
+                (unsigned long long)r.stats.calls, r.activeLanes / calls, r.width,
+                100. * allOn / calls, 100. * mixed / calls, 100. * allOff / calls,
+                100. * r.stats.changes / calls,
+                100. * r.idleLanes / std::max((double)(totalSlots - totalActive), 1.),
+                r.name.c_str());
+
+        // Active lane histogram of the divergent sites
+        if (mixed > 0) {
+            fprintf(out, "%12s lanes", "");
+            for (int l = 0; l <= r.width; ++l)
+                if (r.stats.lanes[l] > 0)
+                    fprintf(out, " %d:%.0f%%", l, 100. * r.stats.lanes[l] / calls);
+            fprintf(out, "\n");
+        }
+    }
+    if ((int)sites.size() > top)
+        fprintf(out, "(%d more sites; set ISPC_INSTRUMENT_TOP to see them)\n",
+                (int)sites.size() - top);
+
+    if (out != stderr)
+        fclose(out);
+}
@@ -0,0 +1,42 @@
+/*
+  Lane utilization profiler for ispc code compiled with --instrument.
+
+  With --instrument, ispc calls ISPCInstrument() at function entries, at
+  every control flow point (if/else, loop bodies, foreach, returns, ...)
+  with the file, a note naming the point, the line and the mask of active
+  program instances.  instrument.cpp implements it: it counts the calls of
+  each site, keeps a histogram of how many lanes were active, and how
+  often the mask was all on, all off or mixed and changed from the
+  previous call.  At exit (or when ISPCPrintInstrument() is called) the
+  sites are printed sorted by the number of idle lane slots they cost,
+  which puts the divergence hotspots at the top.
+
+  The report goes to stderr, or to the file named by the ISPC_INSTRUMENT
+  environment variable.  ISPC_INSTRUMENT_TOP limits the number of sites
+  listed (default 40).  The gang width is taken from the widest mask
+  seen; ISPC_INSTRUMENT_WIDTH overrides it.  The Impala kernels built with
+  targets/instrumented.impala report their cif, each and lanes_at sites
+  here too, by name.
+
+  Build an instrumented example with "make INSTRUMENT=1", or configure
+  with -DISPC_INSTRUMENT=ON to get an <example>_instrumented target next
+  to every example.
+*/
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+
+extern "C" {
+    void ISPCInstrument(const char *fn, const char *note, int line, uint64_t mask);
+    // Called by the instrumented Impala code (see util.impala): count calls
+    // of the named site with the lanes in mask active out of width.
+    void anydsl_instrument(const char *site, const char *note, int32_t mask,
+                           int32_t width, int32_t count);
+}
+
+/* Prints the statistics gathered so far. */
+void ISPCPrintInstrument();
+
+#endif // INSTRUMENT_H
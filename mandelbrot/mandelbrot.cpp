@@ -40,7 +40,7 @@
 
 #include <stdio.h>
 #include <algorithm>
-#include "../timing.h"
+#include "../bench.h"
 #include "mandelbrot_ispc.h"
 #include <string.h>
 #include <cstdlib>
@@ -54,9 +54,13 @@ extern "C" void mandelbrot_impala(float x0, float y0, float x1, float y1,
                               int width, int height, int maxIterations,
                               int output[]);
 
+extern "C" void mandelbrot_impala_tasks(float x0, float y0, float x1, float y1,
+                                    int width, int height, int maxIterations,
+                                    int output[]);
+
 /* Write a PPM image file with the image of the Mandelbrot set */
 static void
-writePPM(int *buf, int width, int height, const char *fn) {
+writePPM(int *buf, int width, int height, const char *fn, FILE *log) {
     FILE *fp = fopen(fn, "wb");
     fprintf(fp, "P6\n");
     fprintf(fp, "%d %d\n", width, height);
@@ -69,18 +73,12 @@ writePPM(int *buf, int width, int height, const char *fn) {
             fputc(c, fp);
     }
     fclose(fp);
-    printf("Wrote image file %s\n", fn);
-}
-
-static double
-median(double* times, size_t n) {
-    if (n == 0) return 0.0f;
-    std::sort(times, times + n);
-    return times[n/2];
+    fprintf(log, "Wrote image file %s\n", fn);
 }
 
 int main(int argc, char *argv[]) {
-    static unsigned int test_iterations[] = {3, 3, 3};
+    // 0 leaves the number of runs to the benchmark harness
+    static unsigned int test_iterations[] = {0, 0, 0};
     unsigned int width = 768;
     unsigned int height = 512;
     float x0 = -2;
@@ -88,6 +86,9 @@ int main(int argc, char *argv[]) {
     float y0 = -1;
     float y1 = 1;
 
+    Bench bench("mandelbrot");
+    argc = bench.parseArgs(argc, argv);
+
     for (int i = 1, iter = 0; i < argc; ++i) {
         if (strncmp(argv[i], "--scale=", 8) == 0) {
             float scale = atof(argv[i] + 8);
@@ -101,30 +102,21 @@ int main(int argc, char *argv[]) {
     int maxIterations = 256;
     int *buf = new int[width*height];
 
-    unsigned int maxTestIters = std::max(test_iterations[0], std::max(test_iterations[1], test_iterations[2]));
-    double times[maxTestIters];
-
-#define BENCH(iter, fn, res, name) \
-    double res = 0.0; \
-    { \
-        for (unsigned int i = 0; i < iter; ++i) { \
-            reset_and_start_timer(); \
-            fn(x0, y0, x1, y1, width, height, maxIterations, buf); \
-            double dt = get_elapsed_mcycles(); \
-            printf("@time of " name " run:\t\t\t[%.3f] million cycles\n", dt); \
-            times[i] = dt; \
-        } \
-        res = median(times, iter); \
-        printf("[mandelbrot " name "]:\t\t[%.3f] million cycles\n", res); \
-        writePPM(buf, width, height, "mandelbrot-" name ".ppm"); \
-        for (unsigned int i = 0; i < width * height; ++i) \
-            buf[i] = 0; \
-    }
-
-    BENCH(test_iterations[0], mandelbrot_ispc,   timeISPC,   "ispc")
-    BENCH(test_iterations[1], mandelbrot_impala, timeImpala, "impala")
-    BENCH(test_iterations[2], mandelbrot_serial, timeSerial, "serial")
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", timeSerial / timeISPC, timeSerial / timeImpala);
+#define BENCH(iter, fn, name) \
+    bench.run(name, iter, [&] { fn(x0, y0, x1, y1, width, height, maxIterations, buf); }); \
+    writePPM(buf, width, height, "mandelbrot-" name ".ppm", bench.logFile()); \
+    for (unsigned int i = 0; i < width * height; ++i) \
+        buf[i] = 0;
+
+    BENCH(test_iterations[0], mandelbrot_ispc,   "ispc")
+    BENCH(test_iterations[1], mandelbrot_impala, "impala")
+    BENCH(test_iterations[0], mandelbrot_ispc_tasks,   "ispc-tasks")
+    BENCH(test_iterations[1], mandelbrot_impala_tasks, "impala-tasks")
+    BENCH(test_iterations[2], mandelbrot_serial, "serial")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("serial", "ispc"), bench.speedup("serial", "impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("serial", "ispc-tasks"), bench.speedup("serial", "impala-tasks"));
 
     return 0;
 }
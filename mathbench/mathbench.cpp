@@ -0,0 +1,301 @@
+/*
+  Copyright (c) 2018, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Accuracy and speed of the transcendentals in util.impala.
+
+  Every function is evaluated by each tier of util.impala (fast, default
+  and exact, the last being the libm calls of cpu_intrinsics) and by the
+  ispc standard library on a grid of inputs over the domain given below.
+  The results are compared against the long double libm, and the maximum
+  error is reported in ulps of the float result, together with the input
+  it occurred at.  The timed runs report ns per element.
+
+  The default tier is also checked at the special inputs (0, negative, inf,
+  NaN, overflow and underflow) against what float libm returns.
+
+  usage: mathbench [--count=<elements>] [--no-timing]
+*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#define NOMINMAX
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "../bench.h"
+#include "mathbench_ispc.h"
+using namespace ispc;
+
+extern "C" void mathbench_impala(int func, int tier, float x[], float y[],
+                                 float out[], float out2[], int n);
+
+// Function numbers, as in mathbench.impala and mathbench.ispc
+enum MathFunc {
+    MATH_EXP, MATH_LOG, MATH_POW, MATH_SIN, MATH_COS, MATH_TAN, MATH_SINCOS
+};
+
+enum MathTier {
+    TIER_FAST, TIER_DEFAULT, TIER_EXACT, TIER_ISPC, NUM_TIERS
+};
+
+static const char *tierNames[NUM_TIERS] = { "fast", "default", "exact", "ispc" };
+
+struct Domain {
+    MathFunc func;
+    const char *name;
+    float lo, hi;       // x range; of log2(x) if logScale
+    bool logScale;
+    bool timed;         // benchmark on this domain
+};
+
+// sin, cos and tan are measured near 0 and far from it, where the argument
+// reduction decides the accuracy; log and pow on denormal x as well.
+static const Domain domains[] = {
+    { MATH_EXP,    "exp",    -87.f, 88.f, false, true },
+    { MATH_LOG,    "log",    -20.f, 20.f, true,  true },
+    { MATH_LOG,    "log",    -149.f, -126.f, true, false },
+    { MATH_POW,    "pow",    -4.f,  4.f,  true,  true },
+    { MATH_POW,    "pow",    -149.f, -126.f, true, false },
+    { MATH_SIN,    "sin",    -3.14159265f, 3.14159265f, false, true },
+    { MATH_SIN,    "sin",    -8192.f, 8192.f, false, false },
+    { MATH_COS,    "cos",    -3.14159265f, 3.14159265f, false, true },
+    { MATH_COS,    "cos",    -8192.f, 8192.f, false, false },
+    { MATH_TAN,    "tan",    -3.14159265f, 3.14159265f, false, true },
+    { MATH_TAN,    "tan",    -8192.f, 8192.f, false, false },
+    { MATH_SINCOS, "sincos", -3.14159265f, 3.14159265f, false, true },
+};
+
+// pow's exponent range; the error of exp(y log x) grows with |y log x|
+#define POW_Y_RANGE 16.f
+
+static long double
+reference(MathFunc func, long double x, long double y, bool second) {
+    switch (func) {
+    case MATH_EXP: return expl(x);
+    case MATH_LOG: return logl(x);
+    case MATH_POW: return powl(x, y);
+    case MATH_SIN: return sinl(x);
+    case MATH_COS: return cosl(x);
+    case MATH_TAN: return tanl(x);
+    case MATH_SINCOS: return second ? cosl(x) : sinl(x);
+    }
+    return 0;
+}
+
+/* Error of v in units of the last place of the float nearest to ref. */
+static double
+ulpError(float v, long double ref) {
+    if (isnan(v) || isnan(ref))
+        return isnan(v) && isnan(ref) ? 0. : INFINITY;
+    // Beyond the float range the correctly rounded result is 0 or inf
+    if (isinf((float)ref) || (float)ref == 0.f)
+        ref = (float)ref;
+    if (isinf(ref) || isinf(v))
+        return v == ref ? 0. : INFINITY;
+    int e;
+    frexpl(ref, &e);
+    // float has 24 bits of mantissa, and denormals a fixed ulp of 2^-149
+    long double ulp = ldexpl(1.L, std::max(e - 24, -149));
+    return (double)(fabsl((long double)v - ref) / ulp);
+}
+
+static void
+evaluate(MathFunc func, int tier, float *x, float *y, float *out, float *out2, int n) {
+    if (tier == TIER_ISPC)
+        mathbench_ispc(func, x, y, out, out2, n);
+    else
+        mathbench_impala(func, tier, x, y, out, out2, n);
+}
+
+static void
+fillInputs(const Domain &d, float *x, float *y, int n) {
+    for (int i = 0; i < n; ++i) {
+        // Evenly spaced, so that consecutive runs cover the same points
+        float t = d.lo + (d.hi - d.lo) * ((i + .5f) / n);
+        x[i] = d.logScale ? exp2f(t) : t;
+        y[i] = POW_Y_RANGE * (2.f * ((i * 0x9E3779B1u) >> 8) / (1 << 24) - 1.f);
+    }
+}
+
+static void
+checkSpecials(FILE *log) {
+    static const float exps[] = { 0.f, -0.f, 1.f, 88.7f, 89.f, -87.5f, -100.f, -104.f,
+                                  INFINITY, -INFINITY, NAN };
+    static const float logs[] = { 1.f, 0.f, -0.f, -1.f, 1e-30f, 1e-40f, 1.4e-45f, 3e38f,
+                                  INFINITY, -INFINITY, NAN };
+    // pow(x, y) pairs: 0, inf and NaN on either side, and negative x with
+    // integer and non-integer y
+    static const float pows[][2] = {
+        { 0.f, 0.f }, { INFINITY, 0.f }, { NAN, 0.f }, { NAN, -0.f }, { 1.f, NAN },
+        { 1.f, INFINITY }, { -1.f, INFINITY }, { -1.f, -INFINITY }, { -2.f, 3.f },
+        { -2.f, 2.f }, { -2.f, -3.f }, { -2.f, 0.5f }, { -8.f, 1.f / 3.f }, { 0.f, -1.f },
+        { -0.f, -1.f }, { -0.f, -2.f }, { -0.f, 3.f }, { -0.f, 0.5f }, { 0.5f, INFINITY },
+        { 2.f, -INFINITY }, { INFINITY, -2.f }, { -INFINITY, 3.f }, { -INFINITY, -3.f },
+        { -INFINITY, 0.5f }, { -1.5f, 33.f }, { -1.f, 16777217.f }, { 2.f, NAN }, { NAN, 1.f }
+    };
+    const int nExp = sizeof(exps) / sizeof(exps[0]), nLog = sizeof(logs) / sizeof(logs[0]);
+    const int nPow = sizeof(pows) / sizeof(pows[0]);
+    float x[32], y[32] = { 0 }, out[32], out2[32];
+    int bad = 0;
+
+    memcpy(x, exps, sizeof(exps));
+    mathbench_impala(MATH_EXP, TIER_DEFAULT, x, y, out, out2, nExp);
+    for (int i = 0; i < nExp; ++i)
+        if (ulpError(out[i], expl((long double)x[i])) > 1.5) {
+            fprintf(log, "default exp(%g) = %g, expected %g\n", x[i], out[i], expf(x[i]));
+            ++bad;
+        }
+    memcpy(x, logs, sizeof(logs));
+    mathbench_impala(MATH_LOG, TIER_DEFAULT, x, y, out, out2, nLog);
+    for (int i = 0; i < nLog; ++i)
+        if (ulpError(out[i], logl((long double)x[i])) > 1.5) {
+            fprintf(log, "default log(%g) = %g, expected %g\n", x[i], out[i], logf(x[i]));
+            ++bad;
+        }
+    for (int i = 0; i < nPow; ++i) {
+        x[i] = pows[i][0];
+        y[i] = pows[i][1];
+    }
+    mathbench_impala(MATH_POW, TIER_DEFAULT, x, y, out, out2, nPow);
+    for (int i = 0; i < nPow; ++i) {
+        long double ref = powl((long double)x[i], (long double)y[i]);
+        // ulpError() doesn't look at the sign of zero results
+        if (ulpError(out[i], ref) > 1.5 || ((float)ref == 0.f && signbit(out[i]) != signbit(ref))) {
+            fprintf(log, "default pow(%g, %g) = %g, expected %g\n", x[i], y[i], out[i],
+                    powf(x[i], y[i]));
+            ++bad;
+        }
+    }
+    fprintf(log, "default tier special cases: %s\n", bad ? "FAILED" : "ok");
+}
+
+int main(int argc, char *argv[]) {
+    int n = 1 << 20;
+    bool timing = true;
+
+    Bench bench("mathbench");
+    argc = bench.parseArgs(argc, argv);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--count=", 8) == 0)
+            n = std::max(1, atoi(argv[i] + 8));
+        else if (strcmp(argv[i], "--no-timing") == 0)
+            timing = false;
+        else {
+            printf("usage: mathbench [--count=<elements>] [--no-timing]\n");
+            return 1;
+        }
+    }
+
+    float *x = new float[n], *y = new float[n];
+    float *out = new float[n], *out2 = new float[n];
+    const int nDomains = sizeof(domains) / sizeof(domains[0]);
+    double maxUlp[nDomains][NUM_TIERS], nsPerElement[nDomains][NUM_TIERS];
+    float worstX[nDomains][NUM_TIERS];
+
+    for (int d = 0; d < nDomains; ++d) {
+        const Domain &dom = domains[d];
+        fillInputs(dom, x, y, n);
+        for (int tier = 0; tier < NUM_TIERS; ++tier) {
+            evaluate(dom.func, tier, x, y, out, out2, n);
+            maxUlp[d][tier] = 0.;
+            worstX[d][tier] = 0.f;
+            for (int i = 0; i < n; ++i) {
+                long double ref = reference(dom.func, x[i], y[i], false);
+                double err = ulpError(out[i], ref);
+                if (dom.func == MATH_SINCOS)
+                    err = std::max(err, ulpError(out2[i], reference(dom.func, x[i], y[i], true)));
+                if (!(err <= maxUlp[d][tier])) {
+                    maxUlp[d][tier] = err;
+                    worstX[d][tier] = x[i];
+                }
+            }
+
+            nsPerElement[d][tier] = 0.;
+            if (timing && dom.timed) {
+                char variant[64];
+                snprintf(variant, sizeof(variant), "%s-%s", dom.name, tierNames[tier]);
+                BenchResult r = bench.run(variant, 0, [&] {
+                    evaluate(dom.func, tier, x, y, out, out2, n);
+                }, std::function<void()>(), n);
+                nsPerElement[d][tier] = r.metric("usec_per_op")->stats.median * 1e3;
+            }
+        }
+    }
+
+    // The table goes to the log with the rest of the text output, so that
+    // stdout only carries the report with --bench-format.
+    FILE *log = bench.logFile();
+    fprintf(log, "\n%-8s %-20s", "function", "domain");
+    for (int tier = 0; tier < NUM_TIERS; ++tier)
+        fprintf(log, " %16s", tierNames[tier]);
+    fprintf(log, "\n%-29s", "");
+    for (int tier = 0; tier < NUM_TIERS; ++tier)
+        fprintf(log, " %16s", "max ulp  ns/elt");
+    fprintf(log, "\n");
+    for (int d = 0; d < nDomains; ++d) {
+        const Domain &dom = domains[d];
+        char range[64];
+        if (dom.logScale)
+            snprintf(range, sizeof(range), "[2^%g, 2^%g]", dom.lo, dom.hi);
+        else
+            snprintf(range, sizeof(range), "[%g, %g]", dom.lo, dom.hi);
+        fprintf(log, "%-8s %-20s", dom.name, range);
+        for (int tier = 0; tier < NUM_TIERS; ++tier) {
+            if (dom.timed && timing)
+                fprintf(log, " %9.3g %6.2f", maxUlp[d][tier], nsPerElement[d][tier]);
+            else
+                fprintf(log, " %9.3g %6s", maxUlp[d][tier], "");
+        }
+        fprintf(log, "\n");
+    }
+    fprintf(log, "\nworst inputs:\n");
+    for (int d = 0; d < nDomains; ++d) {
+        fprintf(log, "%-8s", domains[d].name);
+        for (int tier = 0; tier < NUM_TIERS; ++tier)
+            fprintf(log, " %s %-12g", tierNames[tier], worstX[d][tier]);
+        fprintf(log, "\n");
+    }
+    checkSpecials(log);
+
+    delete[] x;
+    delete[] y;
+    delete[] out;
+    delete[] out2;
+    return 0;
+}
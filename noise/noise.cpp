@@ -41,13 +41,14 @@
 #include <cstdlib>
 #include <stdio.h>
 #include <algorithm>
-#include "../timing.h"
+#include "../bench.h"
 #include "noise_ispc.h"
 #include <string.h>
 using namespace ispc;
 
 extern void noise_serial(float x0, float y0, float x1, float y1, int width, int height, float output[]);
 extern "C" void noise_impala(float x0, float y0, float x1, float y1, int width, int height, float output[]);
+extern "C" void noise_impala_tasks(float x0, float y0, float x1, float y1, int width, int height, float output[]);
 
 /* Write a PPM image file with the image */
 static void
@@ -66,16 +67,9 @@ writePPM(float *buf, int width, int height, const char *fn) {
     fclose(fp);
 }
 
-static double
-median(double* times, size_t n) {
-    if (n == 0) return 0.0f;
-    std::sort(times, times + n);
-    return times[n/2];
-}
-
-
 int main(int argc, char *argv[]) {
-    static unsigned int test_iterations[] = {3, 3, 3};
+    // 0 leaves the number of runs to the benchmark harness
+    static unsigned int test_iterations[] = {0, 0, 0};
     unsigned int width = 768;
     unsigned int height = 768;
     float x0 = -10;
@@ -83,6 +77,9 @@ int main(int argc, char *argv[]) {
     float y0 = -10;
     float y1 = 10;
 
+    Bench bench("noise");
+    argc = bench.parseArgs(argc, argv);
+
     if (argc > 1) {
         if (strncmp(argv[1], "--scale=", 8) == 0) {
             float scale = atof(argv[1] + 8);
@@ -97,27 +94,20 @@ int main(int argc, char *argv[]) {
     }
     float *buf = new float[width*height];
 
-    unsigned int maxTestIters = std::max(test_iterations[0], std::max(test_iterations[1], test_iterations[2]));
-    double times[maxTestIters];
-
-#define BENCH(iter, fn, res, name) \
-    double res; \
-    for (unsigned int i = 0; i < iter; ++i) { \
-        reset_and_start_timer(); \
-        fn(x0, y0, x1, y1, width, height, buf); \
-        double dt = get_elapsed_mcycles(); \
-        printf("@time of " name " run:\t\t\t[%.3f] million cycles\n", dt); \
-        times[i] = dt; \
-    } \
-    res = median(times, iter); \
-    printf("[noise " name "]:\t\t\t[%.3f] million cycles\n", res); \
+#define BENCH(iter, fn, name) \
+    bench.run(name, iter, [&] { fn(x0, y0, x1, y1, width, height, buf); }); \
     writePPM(buf, width, height, "noise-" name ".ppm"); \
     for (unsigned int i = 0; i < width * height; ++i) \
         buf[i] = 0;
 
-    BENCH(test_iterations[0], noise_ispc,   timeISPC,   "ispc")
-    BENCH(test_iterations[1], noise_impala, timeImpala, "impala")
-    BENCH(test_iterations[2], noise_serial, timeSerial, "serial")
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", timeSerial / timeISPC, timeSerial / timeImpala);
+    BENCH(test_iterations[0], noise_ispc,   "ispc")
+    BENCH(test_iterations[1], noise_impala, "impala")
+    BENCH(test_iterations[0], noise_ispc_tasks,   "ispc-tasks")
+    BENCH(test_iterations[1], noise_impala_tasks, "impala-tasks")
+    BENCH(test_iterations[2], noise_serial, "serial")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("serial", "ispc"), bench.speedup("serial", "impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("serial", "ispc-tasks"), bench.speedup("serial", "impala-tasks"));
     return 0;
 }
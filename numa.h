@@ -0,0 +1,207 @@
+/*
+  NUMA-aware allocation for the example drivers.
+
+  numa_new<T>(count) returns page-aligned memory whose placement follows
+  the policy chosen with the ISPC_NUMA_POLICY environment variable:
+
+    first-touch  (default) the pages are touched by a tasked pass over the
+                 buffer, so each one lands on the node of the worker that
+                 touched it.  A driver that initializes the buffer with
+                 numa_parallel_for() itself passes touch = false, so that
+                 its own pass decides.  With the fully subscribed task
+                 system, whose launches hand the same index ranges to the
+                 same node every time, the ispc tasks that later sweep the
+                 buffer in order mostly find their slice local.
+    interleave   pages are spread round-robin over all allowed nodes, which
+                 evens out the bandwidth for data that every task reads.
+    local        all pages go to the node of the allocating thread; this is
+                 what a serial initialization loop gives you and serves as
+                 the baseline.
+
+  numa_parallel_for() splits an index range into contiguous slices and runs
+  them as tasks; drivers use it to initialize their data in parallel, which
+  with the first-touch policy also decides where it lives.
+
+  On other platforms, or if the kernel refuses the memory policy, this
+  falls back to ordinary allocations.
+*/
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+extern "C" {
+    void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
+    void ISPCSync(void *handle);
+}
+
+enum NumaPolicy {
+    NUMA_FIRST_TOUCH,
+    NUMA_INTERLEAVE,
+    NUMA_LOCAL
+};
+
+// Number of tasks numa_parallel_for() splits its range into
+#define NUMA_PARALLEL_TASKS 64
+
+static inline const char *
+numa_policy_name(NumaPolicy policy) {
+    static const char *names[] = { "first-touch", "interleave", "local" };
+    return names[policy];
+}
+
+/* Nodes this process may allocate on, as a bit mask; 1 if unknown. */
+static inline unsigned long
+numa_allowed_nodes() {
+#ifdef __linux__
+    unsigned long mask = 0;
+    if (syscall(SYS_get_mempolicy, NULL, &mask, sizeof(mask) * 8, NULL, MPOL_F_MEMS_ALLOWED) == 0 &&
+        mask != 0)
+        return mask;
+#endif
+    return 1;
+}
+
+static inline NumaPolicy
+numa_policy() {
+    static int policy = -1;
+    if (policy < 0) {
+        policy = NUMA_FIRST_TOUCH;
+        const char *env = getenv("ISPC_NUMA_POLICY");
+        if (env != NULL && *env != '\0') {
+            for (int i = NUMA_FIRST_TOUCH; i <= NUMA_LOCAL; ++i)
+                if (strcmp(env, numa_policy_name((NumaPolicy)i)) == 0)
+                    policy = i;
+            if (strcmp(env, numa_policy_name((NumaPolicy)policy)) != 0)
+                fprintf(stderr, "Unknown ISPC_NUMA_POLICY \"%s\", using first-touch\n", env);
+        }
+        unsigned long nodes = numa_allowed_nodes();
+        if (nodes & (nodes - 1))
+            fprintf(stderr, "numa: %s placement over %d nodes\n",
+                    numa_policy_name((NumaPolicy)policy), __builtin_popcountl(nodes));
+    }
+    return (NumaPolicy)policy;
+}
+
+struct NumaParallelFor {
+    const std::function<void(int, int)> *body;
+    int begin, end;
+};
+
+static void
+numa_parallel_for_task(void *data, int threadIndex, int threadCount,
+                       int taskIndex, int taskCount,
+                       int taskIndex0, int taskIndex1, int taskIndex2,
+                       int taskCount0, int taskCount1, int taskCount2) {
+    const NumaParallelFor *p = (const NumaParallelFor *)data;
+    int64_t n = p->end - p->begin;
+    int b = p->begin + (int)(n * taskIndex / taskCount);
+    int e = p->begin + (int)(n * (taskIndex + 1) / taskCount);
+    if (b < e)
+        (*p->body)(b, e);
+}
+
+/* Calls body(b, e) for contiguous slices [b, e) covering [begin, end),
+   in parallel on the task system, and returns once all are done. */
+static inline void
+numa_parallel_for(int begin, int end, const std::function<void(int, int)> &body) {
+    if (end <= begin)
+        return;
+    NumaParallelFor p = { &body, begin, end };
+    int count = std::min(end - begin, NUMA_PARALLEL_TASKS);
+    void *handle = NULL;
+    ISPCLaunch(&handle, (void *)numa_parallel_for_task, &p, count, 1, 1);
+    ISPCSync(handle);
+}
+
+static inline size_t
+numa_page_size() {
+#ifdef __linux__
+    return (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 4096;
+#endif
+}
+
+/* Returns size bytes placed according to numa_policy(); the memory is
+   zeroed.  Unless touch is false, the pages are faulted in from the task
+   system before returning.  Free with numa_free(). */
+static inline void *
+numa_alloc(size_t size, bool touch = true) {
+    NumaPolicy policy = numa_policy();
+    size_t page = numa_page_size();
+    size_t bytes = (size + page - 1) / page * page;
+#ifdef __linux__
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (policy == NUMA_INTERLEAVE) {
+        unsigned long nodes = numa_allowed_nodes();
+        syscall(SYS_mbind, ptr, bytes, MPOL_INTERLEAVE, &nodes, sizeof(nodes) * 8, 0);
+    } else if (policy == NUMA_LOCAL) {
+        unsigned int cpu, node;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+            unsigned long nodes = 1ul << node;
+            syscall(SYS_mbind, ptr, bytes, MPOL_BIND, &nodes, sizeof(nodes) * 8, 0);
+        }
+    }
+#else
+    void *ptr = calloc(bytes, 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Out of memory allocating %zu bytes\n", bytes);
+        exit(1);
+    }
+#endif
+
+    // Touch every page from the task system; with the first-touch policy
+    // this is what places them, with the others it only faults them in
+    // ahead of the timed runs.
+    if (touch) {
+        char *base = (char *)ptr;
+        numa_parallel_for(0, (int)(bytes / page), [=](int b, int e) {
+            for (int i = b; i < e; ++i)
+                base[(size_t)i * page] = 0;
+        });
+    }
+    return ptr;
+}
+
+static inline void
+numa_free(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return;
+#ifdef __linux__
+    size_t page = numa_page_size();
+    munmap(ptr, (size + page - 1) / page * page);
+#else
+    (void)size;
+    free(ptr);
+#endif
+}
+
+template <typename T> static inline T *
+numa_new(size_t count, bool touch = true) {
+    return (T *)numa_alloc(count * sizeof(T), touch);
+}
+
+template <typename T> static inline void
+numa_delete(T *ptr, size_t count) {
+    numa_free(ptr, count * sizeof(T));
+}
+
+#endif // NUMA_H
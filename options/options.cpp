@@ -42,7 +42,7 @@
 using std::max;
 
 #include "options_defs.h"
-#include "../timing.h"
+#include "../bench.h"
 
 #include "options_ispc.h"
 using namespace ispc;
@@ -51,21 +51,19 @@ extern     void black_scholes_serial(float Sa[], float Xa[], float Ta[], float r
 extern "C" void black_scholes_impala(float Sa[], float Xa[], float Ta[], float ra[], float va[], float result[], int count);
 extern     void binomial_put_serial (float Sa[], float Xa[], float Ta[], float ra[], float va[], float result[], int count);
 extern "C" void binomial_put_impala (float Sa[], float Xa[], float Ta[], float ra[], float va[], float result[], int count);
+extern "C" void black_scholes_impala_tasks(float Sa[], float Xa[], float Ta[], float ra[], float va[], float result[], int count);
+extern "C" void binomial_put_impala_tasks (float Sa[], float Xa[], float Ta[], float ra[], float va[], float result[], int count);
 
 static void usage() {
     printf("usage: options [--count=<num options>]\n");
 }
 
-static double
-median(double* times, size_t n) {
-    if (n == 0) return 0.0f;
-    std::sort(times, times + n);
-    return times[n/2];
-}
-
 int main(int argc, char *argv[]) {
     int nOptions = 128*1024;
 
+    Bench bench("options");
+    argc = bench.parseArgs(argc, argv);
+
     for (int i = 1; i < argc; ++i) {
         if (strncmp(argv[i], "--count=", 8) == 0) {
             nOptions = atoi(argv[i] + 8);
@@ -76,7 +74,8 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    int maxIters = 7;
+    // 0 leaves the number of runs to the benchmark harness
+    int maxIters = 0;
 
     float *S = new float[nOptions];
     float *X = new float[nOptions];
@@ -84,7 +83,6 @@ int main(int argc, char *argv[]) {
     float *r = new float[nOptions];
     float *v = new float[nOptions];
     float *result = new float[nOptions];
-    double* times = new double[maxIters];
 
     for (int i = 0; i < nOptions; ++i) {
         S[i] = 100;  // stock price
@@ -94,33 +92,38 @@ int main(int argc, char *argv[]) {
         v[i] = 5;    // volatility
     }
 
-    double sum;
-    double timeISPC, timeImpala, timeSerial;
-
-#define BENCH(iters, fn, res, name) \
+#define BENCH(iters, fn, name) \
     { \
-        for (int i = 0; i < iters; ++i) { \
-            reset_and_start_timer(); \
-            fn(S, X, T, r, v, result, nOptions); \
-            double dt = get_elapsed_mcycles(); \
-            sum = 0.; \
-            for (int i = 0; i < nOptions; ++i) \
-                sum += result[i]; \
-            times[i] = dt; \
-        } \
-        res = median(times, iters); \
-        printf("[" name "]:\t[%.3f] million cycles (avg %f)\n", res, sum / nOptions); \
+        bench.run(name, iters, [&] { fn(S, X, T, r, v, result, nOptions); }); \
+        double sum = 0.; \
+        for (int i = 0; i < nOptions; ++i) \
+            sum += result[i]; \
+        fprintf(bench.logFile(), "[" name "]:\t(avg %f)\n", sum / nOptions); \
     }
 
-    BENCH(7, binomial_put_ispc,   timeISPC,   "binomial ispc")
-    BENCH(7, binomial_put_impala, timeImpala, "binomial impala")
-    BENCH(7, binomial_put_serial, timeSerial, "binomial serial")
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", timeSerial / timeISPC, timeSerial / timeImpala);
-
-    BENCH(7, black_scholes_ispc,   timeISPC,   "black-scholes ispc")
-    BENCH(7, black_scholes_impala, timeImpala, "black-scholes impala")
-    BENCH(7, black_scholes_serial, timeSerial, "black-scholes serial")
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", timeSerial / timeISPC, timeSerial / timeImpala);
+    BENCH(maxIters, binomial_put_ispc,   "binomial ispc")
+    BENCH(maxIters, binomial_put_impala, "binomial impala")
+    BENCH(maxIters, binomial_put_ispc_tasks,   "binomial ispc-tasks")
+    BENCH(maxIters, binomial_put_impala_tasks, "binomial impala-tasks")
+    BENCH(maxIters, binomial_put_serial, "binomial serial")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("binomial serial", "binomial ispc"),
+            bench.speedup("binomial serial", "binomial impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("binomial serial", "binomial ispc-tasks"),
+            bench.speedup("binomial serial", "binomial impala-tasks"));
+
+    BENCH(maxIters, black_scholes_ispc,   "black-scholes ispc")
+    BENCH(maxIters, black_scholes_impala, "black-scholes impala")
+    BENCH(maxIters, black_scholes_ispc_tasks,   "black-scholes ispc-tasks")
+    BENCH(maxIters, black_scholes_impala_tasks, "black-scholes impala-tasks")
+    BENCH(maxIters, black_scholes_serial, "black-scholes serial")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("black-scholes serial", "black-scholes ispc"),
+            bench.speedup("black-scholes serial", "black-scholes impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("black-scholes serial", "black-scholes ispc-tasks"),
+            bench.speedup("black-scholes serial", "black-scholes impala-tasks"));
 
     return 0;
 }
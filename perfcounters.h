@@ -0,0 +1,176 @@
+/*
+  Hardware performance counters for the example drivers.
+
+  On Linux a group of perf events is opened for the calling process:
+  cycles, instructions, L1D read misses, LLC misses, branch misses and
+  dTLB read misses.  The events are opened with inherit set, so threads
+  created afterwards (e.g. the task system's workers) are counted as well;
+  open the counters before the first ispc launch to cover them.  Each
+  counter is read individually and scaled by its enabled/running times in
+  case the kernel had to multiplex the group.
+
+  When perf_event_open() is not permitted (see
+  /proc/sys/kernel/perf_event_paranoid) or not available, available()
+  returns false and the harness falls back to timing only.  Events the
+  CPU doesn't support are skipped individually.
+*/
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfCounterId {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NUM_COUNTERS
+};
+
+struct PerfCounterValues {
+    bool valid[PERF_NUM_COUNTERS];
+    double count[PERF_NUM_COUNTERS];
+
+    double ipc() const {
+        if (!valid[PERF_CYCLES] || !valid[PERF_INSTRUCTIONS] || count[PERF_CYCLES] == 0.0)
+            return 0.0;
+        return count[PERF_INSTRUCTIONS] / count[PERF_CYCLES];
+    }
+
+    /* Every LLC miss is assumed to fetch one cache line from DRAM;
+       prefetches and write-backs are not accounted for. */
+    double dramBytes(int lineSize = 64) const {
+        return valid[PERF_LLC_MISSES] ? count[PERF_LLC_MISSES] * lineSize : 0.0;
+    }
+};
+
+class PerfCounters {
+public:
+    PerfCounters() : lineSize(64) {
+        for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+            fd[i] = -1;
+            base[i] = 0.0;
+        }
+#ifdef __linux__
+        long ls = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+        if (ls > 0)
+            lineSize = (int)ls;
+        open();
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int i = PERF_NUM_COUNTERS - 1; i >= 0; --i)
+            if (fd[i] >= 0)
+                close(fd[i]);
+#endif
+    }
+
+    bool available() const { return fd[PERF_CYCLES] >= 0; }
+    int cacheLineSize() const { return lineSize; }
+
+    static const char *name(int id) {
+        static const char *names[PERF_NUM_COUNTERS] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses",
+            "branch_misses", "dtlb_misses"
+        };
+        return names[id];
+    }
+
+    /* Records the current counter values as the start of an interval. */
+    void start() {
+        for (int i = 0; i < PERF_NUM_COUNTERS; ++i)
+            base[i] = read(i);
+    }
+
+    /* Returns the events counted since the last start(). */
+    PerfCounterValues stop() {
+        PerfCounterValues v;
+        for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+            v.valid[i] = fd[i] >= 0;
+            v.count[i] = v.valid[i] ? read(i) - base[i] : 0.0;
+        }
+        return v;
+    }
+
+private:
+#ifdef __linux__
+    int openEvent(uint32_t type, uint64_t config, int groupFd) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = groupFd < 0 ? 1 : 0;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+    }
+
+    void open() {
+        static const uint64_t cacheRead = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        fd[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (fd[PERF_CYCLES] < 0) {
+            int paranoid = -1;
+            FILE *fp = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+            if (fp) {
+                if (fscanf(fp, "%d", &paranoid) != 1)
+                    paranoid = -1;
+                fclose(fp);
+            }
+            fprintf(stderr, "Hardware performance counters unavailable (%s, perf_event_paranoid=%d); "
+                    "reporting timing only\n", strerror(errno), paranoid);
+            return;
+        }
+
+        int leader = fd[PERF_CYCLES];
+        fd[PERF_INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, leader);
+        fd[PERF_L1D_MISSES] = openEvent(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cacheRead, leader);
+        fd[PERF_LLC_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, leader);
+        fd[PERF_BRANCH_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, leader);
+        fd[PERF_DTLB_MISSES] = openEvent(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | cacheRead, leader);
+
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+
+    double read(int i) const {
+#ifdef __linux__
+        if (fd[i] < 0)
+            return 0.0;
+        uint64_t data[3];  // value, time enabled, time running
+        if (::read(fd[i], data, sizeof(data)) != (ssize_t)sizeof(data))
+            return 0.0;
+        if (data[2] == 0)
+            return 0.0;
+        return (double)data[0] * ((double)data[1] / (double)data[2]);
+#else
+        (void)i;
+        return 0.0;
+#endif
+    }
+
+    int fd[PERF_NUM_COUNTERS];
+    double base[PERF_NUM_COUNTERS];
+    int lineSize;
+};
+
+#endif // PERFCOUNTERS_H
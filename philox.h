@@ -0,0 +1,48 @@
+/*
+  Philox4x32-10 counter based random numbers for the serial C++ versions
+  of the examples; the same generator as random4() in util.impala and
+  philox.isph, so all three draw identical numbers for the same counter
+  and seed.  See util.impala for a description.
+*/
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stdint.h>
+#include <string.h>
+
+struct Random4 {
+    uint32_t x, y, z, w;
+};
+
+static inline Random4
+philox4x32(Random4 c, uint32_t k0, uint32_t k1) {
+    for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * c.x;
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c.z;
+        Random4 n = { (uint32_t)(p1 >> 32) ^ c.y ^ k0, (uint32_t)p1,
+                      (uint32_t)(p0 >> 32) ^ c.w ^ k1, (uint32_t)p0 };
+        c = n;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    return c;
+}
+
+/* Four random numbers for counter (a, b, c) of the stream seed. */
+static inline Random4
+random4(uint32_t a, uint32_t b, uint32_t c, uint32_t seed) {
+    Random4 counter = { a, b, c, 0 };
+    return philox4x32(counter, seed, 0x243F6A88u);
+}
+
+/* Maps the upper 23 bits of r to [0, 1). */
+static inline float
+random_unit(uint32_t r) {
+    uint32_t bits = 0x3F800000u | (r >> 9);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f - 1.0f;
+}
+
+#endif // PHILOX_H
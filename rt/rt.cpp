@@ -44,7 +44,7 @@
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
-#include "../timing.h"
+#include "../bench.h"
 #include "rt_ispc.h"
 
 using namespace ispc;
@@ -56,10 +56,20 @@ extern void raytrace_serial(int width, int height, int baseWidth, int baseHeight
                             const float camera2world[4][4], float image[],
                             int id[], const LinearBVHNode nodes[],
                             const Triangle triangles[]);
+extern "C" void raytrace_impala(int width, int height, int baseWidth, int baseHeight,
+                                const float raster2camera[4][4],
+                                const float camera2world[4][4], float image[],
+                                int id[], const LinearBVHNode nodes[],
+                                const Triangle triangles[]);
+extern "C" void raytrace_impala_tasks(int width, int height, int baseWidth, int baseHeight,
+                                      const float raster2camera[4][4],
+                                      const float camera2world[4][4], float image[],
+                                      int id[], const LinearBVHNode nodes[],
+                                      const Triangle triangles[]);
 
 
 static void writeImage(int *idImage, float *depthImage, int width, int height,
-                       const char *filename) {
+                       const char *filename, FILE *log) {
     FILE *f = fopen(filename, "wb");
     if (!f) {
         perror(filename);
@@ -91,18 +101,33 @@ static void writeImage(int *idImage, float *depthImage, int width, int height,
         }
     }
     fclose(f);
-    printf("Wrote image file %s\n", filename);
+    fprintf(log, "Wrote image file %s\n", filename);
+}
+
+
+static void checkIds(const char *name, const int *id, const int *reference, int n,
+                     FILE *log) {
+    int mismatches = 0;
+    for (int i = 0; i < n; ++i)
+        if (id[i] != reference[i])
+            ++mismatches;
+    if (mismatches > 0)
+        fprintf(log, "%s: %d pixels hit a different triangle than in the serial version\n",
+                name, mismatches);
 }
 
 
 static void usage() {
-    fprintf(stderr, "rt <scene name base> [--scale=<factor>] [ispc iterations] [tasks iterations] [serial iterations]\n");
+    fprintf(stderr, "rt <scene name base> [--scale=<factor>] [ispc iterations] [impala iterations] [serial iterations]\n");
     exit(1);
 }
 
 
 int main(int argc, char *argv[]) {
-    static unsigned int test_iterations[] = {3, 7, 1};
+    // 0 leaves the number of runs to the benchmark harness
+    static unsigned int test_iterations[] = {0, 0, 0};
+    Bench bench("rt");
+    argc = bench.parseArgs(argc, argv);
     float scale = 1.f;
     const char *filename = NULL;
     if (argc < 2) usage();
@@ -207,65 +232,31 @@ int main(int argc, char *argv[]) {
     int *id = new int[width*height];
     float *image = new float[width*height];
 
-    //
-    // Run 3 iterations with ispc + 1 core, record the minimum time
-    //
-    double minTimeISPC = 1e30;
-    for (uint i = 0; i < test_iterations[0]; ++i) {
-        reset_and_start_timer();
-        raytrace_ispc(width, height, baseWidth, baseHeight, raster2camera,
-                      camera2world, image, id, nodes, triangles);
-        double dt = get_elapsed_mcycles();
-        printf("@time of ISPC run:\t\t\t[%.3f] million cycles\n", dt);
-        minTimeISPC = std::min(dt, minTimeISPC);
-    }
-    printf("[rt ispc, 1 core]:\t\t[%.3f] million cycles for %d x %d image\n",
-           minTimeISPC, width, height);
-
-    writeImage(id, image, width, height, "rt-ispc-1core.ppm");
-
-    memset(id, 0, width*height*sizeof(int));
-    memset(image, 0, width*height*sizeof(float));
-
-    //
-    // Run 3 iterations with ispc + 1 core, record the minimum time
-    //
-    double minTimeISPCtasks = 1e30;
-    for (uint i = 0; i < test_iterations[1]; ++i) {
-        reset_and_start_timer();
-        raytrace_ispc_tasks(width, height, baseWidth, baseHeight, raster2camera,
-                            camera2world, image, id, nodes, triangles);
-        double dt = get_elapsed_mcycles();
-        printf("@time of ISPC + TASKS run:\t\t\t[%.3f] million cycles\n", dt);
-        minTimeISPCtasks = std::min(dt, minTimeISPCtasks);
-    }
-    printf("[rt ispc + tasks]:\t\t[%.3f] million cycles for %d x %d image\n",
-           minTimeISPCtasks, width, height);
-
-    writeImage(id, image, width, height, "rt-ispc-tasks.ppm");
-
-    memset(id, 0, width*height*sizeof(int));
-    memset(image, 0, width*height*sizeof(float));
-
-    //
-    // And 3 iterations with the serial implementation, reporting the
-    // minimum time.
-    //
-    double minTimeSerial = 1e30;
-    for (uint i = 0; i < test_iterations[2]; ++i) {
-        reset_and_start_timer();
-        raytrace_serial(width, height, baseWidth, baseHeight, raster2camera,
-                        camera2world, image, id, nodes, triangles);
-        double dt = get_elapsed_mcycles();
-        printf("@time of serial run:\t\t\t[%.3f] million cycles\n", dt);
-        minTimeSerial = std::min(dt, minTimeSerial);
-    }
-    printf("[rt serial]:\t\t\t[%.3f] million cycles for %d x %d image\n",
-           minTimeSerial, width, height);
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from ISPC + tasks)\n",
-           minTimeSerial / minTimeISPC, minTimeSerial / minTimeISPCtasks);
-
-    writeImage(id, image, width, height, "rt-serial.ppm");
+    // The hit ids of every version are compared against the serial ones;
+    // all of them traverse the same BVH, so they should agree.
+    int *serialId = new int[width*height];
+    raytrace_serial(width, height, baseWidth, baseHeight, raster2camera,
+                    camera2world, image, serialId, nodes, triangles);
+
+#define BENCH(iter, fn, name, file)                                           \
+    memset(id, 0, width*height*sizeof(int));                                  \
+    memset(image, 0, width*height*sizeof(float));                             \
+    bench.run(name, iter, [&] {                                               \
+        fn(width, height, baseWidth, baseHeight, raster2camera,               \
+           camera2world, image, id, nodes, triangles);                        \
+    });                                                                       \
+    writeImage(id, image, width, height, file, bench.logFile());              \
+    checkIds(name, id, serialId, width*height, bench.logFile());
+
+    BENCH(test_iterations[0], raytrace_ispc,         "ispc",         "rt-ispc-1core.ppm")
+    BENCH(test_iterations[1], raytrace_impala,       "impala",       "rt-impala.ppm")
+    BENCH(test_iterations[0], raytrace_ispc_tasks,   "ispc-tasks",   "rt-ispc-tasks.ppm")
+    BENCH(test_iterations[1], raytrace_impala_tasks, "impala-tasks", "rt-impala-tasks.ppm")
+    BENCH(test_iterations[2], raytrace_serial,       "serial",       "rt-serial.ppm")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("serial", "ispc"), bench.speedup("serial", "impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("serial", "ispc-tasks"), bench.speedup("serial", "impala-tasks"));
 
     return 0;
 }
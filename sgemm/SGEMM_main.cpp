@@ -52,6 +52,7 @@ A        X            B        =            C
 #endif
 
 #include "../timing.h"
+#include "../numa.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -93,6 +94,14 @@ get_elapsed_msec();
 #include "SGEMM_kernels_ispc.h"
 using namespace ispc;
 
+// The AnyDSL kernels (sgemm.impala)
+extern "C" {
+void SGEMM_impala_tileBlock(float matrixA[], float matrixB[], float matrixC[], int M, int N, int K);
+void SGEMM_impala_regBlock(float matrixA[], float matrixB[], float matrixC[], int M, int N, int K);
+void SGEMM_impala_tileBlock_withTasks(float matrixA[], float matrixB[], float matrixC[], int M, int N, int K);
+void SGEMM_impala_regBlock_withTasks(float matrixA[], float matrixB[], float matrixC[], int M, int N, int K);
+}
+
 
 void init_matrix(float M[], unsigned int rows, unsigned int cols, float value) {
     for (unsigned int r = 0; r < rows; r++)
@@ -232,9 +241,13 @@ int main(int argc, char **argv) {
         exit(-1);
     }
 
-    float* matrixA; matrixA = (float*)malloc(M*N * sizeof(float)); init_matrix_rand(matrixA, M, N, 10.0f);
-    float* matrixB; matrixB = (float*)malloc(N*K * sizeof(float)); init_matrix_rand(matrixB, N, K, 10.0f);
-    float* matrixC; matrixC = (float*)malloc(M*K * sizeof(float)); init_matrix_rand(matrixC, M, K, 0.0f);
+    // numa_new() touches the rows from the task system, so with the fully
+    // subscribed build they land on the nodes whose workers run those rows
+    // of the tasked kernels; the serial rand() fill afterwards keeps the
+    // placement.  The pthreads build doesn't schedule by node.
+    float* matrixA; matrixA = numa_new<float>(M*N); init_matrix_rand(matrixA, M, N, 10.0f);
+    float* matrixB; matrixB = numa_new<float>(N*K); init_matrix_rand(matrixB, N, K, 10.0f);
+    float* matrixC; matrixC = numa_new<float>(M*K); init_matrix_rand(matrixC, M, K, 0.0f);
     float* matrixValid; matrixValid = (float*)malloc(M*K * sizeof(float));
     bool tasks = false;
 
@@ -249,6 +262,8 @@ int main(int argc, char **argv) {
     Test_SGEMM((SGEMMFuncPtr)SGEMM_tileNoSIMDIntrin, (char *)"SGEMM_tileNoSIMDIntrin", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
     Test_SGEMM((SGEMMFuncPtr)SGEMM_tileBlockNoSIMDIntrin, (char *)"SGEMM_tileBlockNoSIMDIntrin", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
     Test_SGEMM((SGEMMFuncPtr)SGEMM_tileBlockNoSIMDIntrin_2, (char *)"SGEMM_tileBlockNoSIMDIntrin_2", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
+    Test_SGEMM((SGEMMFuncPtr)SGEMM_impala_tileBlock, (char *)"SGEMM_impala_tileBlock", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
+    Test_SGEMM((SGEMMFuncPtr)SGEMM_impala_regBlock, (char *)"SGEMM_impala_regBlock", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
     printf("\n");
 
     // Multi-threaded test cases:
@@ -260,7 +275,9 @@ int main(int argc, char **argv) {
     Test_SGEMM((SGEMMFuncPtr)SGEMM_tileNoSIMDIntrin_withTasks, (char *)"SGEMM_tileNoSIMDIntrin_withTasks", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
     Test_SGEMM((SGEMMFuncPtr)SGEMM_tileBlockNoSIMDIntrin_withTasks, (char *)"SGEMM_tileBlockNoSIMDIntrin_withTasks", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
     Test_SGEMM((SGEMMFuncPtr)SGEMM_tileBlockNoSIMDIntrin_2_withTasks, (char *)"SGEMM_tileBlockNoSIMDIntrin_2_withTasks", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
+    Test_SGEMM((SGEMMFuncPtr)SGEMM_impala_tileBlock_withTasks, (char *)"SGEMM_impala_tileBlock_withTasks", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
+    Test_SGEMM((SGEMMFuncPtr)SGEMM_impala_regBlock_withTasks, (char *)"SGEMM_impala_regBlock_withTasks", matrixA, matrixB, matrixC, M, N, K, tasks, ITERATIONS, matrixValid);
 
-    free(matrixA); free(matrixB); free(matrixC); free(matrixValid);
+    numa_delete(matrixA, M*N); numa_delete(matrixB, N*K); numa_delete(matrixC, M*K); free(matrixValid);
     return 0;
 }
@@ -42,11 +42,13 @@
 #include <cassert>
 #include <iomanip>
 #include "../timing.h"
+#include "../numa.h"
 #include "sort_ispc.h"
 
 using namespace ispc;
 
 extern void sort_serial (int n, unsigned int code[], int order[]);
+extern "C" void sort_impala (int n, unsigned int code[], int order[], int ntasks);
 
 static void progressBar(const int x, const int n, const int width = 50)
 {
@@ -72,12 +74,23 @@ static void progressBar(const int x, const int n, const int width = 50)
   std::cout << (x == n-1 ? "\n" : "\r") << std::flush;
 }
 
+static void checkOrder(const char *name, const int order[], const int reference[], int n)
+{
+  int mismatches = 0;
+  for (int i = 0; i < n; i++)
+    if (order[i] != reference[i])
+      mismatches++;
+  if (mismatches > 0)
+    printf("%s: order differs from sort_ispc at %d of %d positions\n", name, mismatches, n);
+}
+
 int main (int argc, char *argv[])
 {
   int i, j, n = argc == 1 ? 1000000 : atoi(argv[1]), m = n < 100 ? 1 : 50, l = n < 100 ? n : RAND_MAX;
-  double tISPC1 = 0.0, tISPC2 = 0.0, tSerial = 0.0;
-  unsigned int *code = new unsigned int [n];
-  int *order = new int [n];
+  double tISPC1 = 0.0, tISPC2 = 0.0, tImpala1 = 0.0, tImpala2 = 0.0, tSerial = 0.0;
+  unsigned int *code = numa_new<unsigned int>(n);
+  int *order = numa_new<int>(n);
+  int *orderISPC = new int[n];
 
   srand (0);
 
@@ -97,6 +110,10 @@ int main (int argc, char *argv[])
 
   printf("[sort ispc]:\t[%.3f] million cycles\n", tISPC1);
 
+  // Both radix sorts are stable, so every run on the last input must
+  // produce this exact permutation; sort_serial's std::sort is not.
+  std::copy(order, order + n, orderISPC);
+
   srand (0);
 
   for (i = 0; i < m; i ++)
@@ -114,6 +131,45 @@ int main (int argc, char *argv[])
   }
 
   printf("[sort ispc + tasks]:\t[%.3f] million cycles\n", tISPC2);
+  checkOrder ("ispc + tasks", order, orderISPC, n);
+
+  srand (0);
+
+  for (i = 0; i < m; i ++)
+  {
+    for (j = 0; j < n; j ++) code [j] = rand() % l;
+
+    reset_and_start_timer();
+
+    sort_impala (n, code, order, 1);
+
+    tImpala1 += get_elapsed_mcycles();
+
+    if (argc != 3)
+        progressBar (i, m);
+  }
+
+  printf("[sort impala]:\t\t[%.3f] million cycles\n", tImpala1);
+  checkOrder ("impala", order, orderISPC, n);
+
+  srand (0);
+
+  for (i = 0; i < m; i ++)
+  {
+    for (j = 0; j < n; j ++) code [j] = rand() % l;
+
+    reset_and_start_timer();
+
+    sort_impala (n, code, order, 0);
+
+    tImpala2 += get_elapsed_mcycles();
+
+    if (argc != 3)
+        progressBar (i, m);
+  }
+
+  printf("[sort impala + tasks]:\t[%.3f] million cycles\n", tImpala2);
+  checkOrder ("impala + tasks", order, orderISPC, n);
 
   srand (0);
 
@@ -133,9 +189,11 @@ int main (int argc, char *argv[])
 
   printf("[sort serial]:\t\t[%.3f] million cycles\n", tSerial);
 
-  printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from ISPC + tasks)\n", tSerial/tISPC1, tSerial/tISPC2);
+  printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", tSerial/tISPC1, tSerial/tImpala1);
+  printf("\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + tasks)\n", tSerial/tISPC2, tSerial/tImpala2);
 
-  delete[] code;
-  delete[] order;
+  numa_delete(code, n);
+  numa_delete(order, n);
+  delete[] orderISPC;
   return 0;
 }
@@ -43,7 +43,8 @@
 #include <algorithm>
 #include <string.h>
 #include <math.h>
-#include "../timing.h"
+#include "../bench.h"
+#include "../numa.h"
 #include "stencil_ispc.h"
 
 //#if defined(__x86_64__) || defined(__amd64__) || defined(_M_X64)
@@ -67,22 +68,28 @@ extern "C" void loop_stencil_impala(int t0, int t1, int x0, int x1,
                                     const float vsq[],
                                     float Aeven[], float Aodd[]);
 
+extern "C" void loop_stencil_impala_tasks(int t0, int t1, int x0, int x1,
+                                          int y0, int y1, int z0, int z1,
+                                          int Nx, int Ny, int Nz,
+                                          const float coef[4],
+                                          const float vsq[],
+                                          float Aeven[], float Aodd[]);
+
+// Initializes the z slabs in parallel, split the same way the tasked
+// kernels split them, so first-touch placement keeps each slab on the node
+// that sweeps it.  The buffers are allocated untouched, so that this pass
+// is the first touch.
 void InitData(int Nx, int Ny, int Nz, float *A[2], float *vsq) {
-    int offset = 0;
-    for (int z = 0; z < Nz; ++z)
-        for (int y = 0; y < Ny; ++y)
-            for (int x = 0; x < Nx; ++x, ++offset) {
-                A[0][offset] = (x < Nx / 2) ? x / float(Nx) : y / float(Ny);
-                A[1][offset] = 0;
-                vsq[offset] = x*y*z / float(Nx * Ny * Nz);
-            }
-}
-
-static double
-median(double* times, size_t n) {
-    if (n == 0) return 0.0f;
-    std::sort(times, times + n);
-    return times[n/2];
+    numa_parallel_for(0, Nz, [=](int z0, int z1) {
+        int offset = z0 * Nx * Ny;
+        for (int z = z0; z < z1; ++z)
+            for (int y = 0; y < Ny; ++y)
+                for (int x = 0; x < Nx; ++x, ++offset) {
+                    A[0][offset] = (x < Nx / 2) ? x / float(Nx) : y / float(Ny);
+                    A[1][offset] = 0;
+                    vsq[offset] = x*y*z / float(Nx * Ny * Nz);
+                }
+    });
 }
 
 int main(int argc, char *argv[]) {
@@ -90,10 +97,14 @@ int main(int argc, char *argv[]) {
         //_mm_setcsr(_mm_getcsr() | (_MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON));
     //#endif
 
-    static unsigned int test_iterations[] = {3, 3, 3};//the last two numbers must be equal here
+    // 0 leaves the number of runs to the benchmark harness
+    static unsigned int test_iterations[] = {0, 0, 0};//the last two numbers must be equal here
     int Nx = 256, Ny = 256, Nz = 256;
     int width = 4;
 
+    Bench bench("stencil");
+    argc = bench.parseArgs(argc, argv);
+
     if (argc > 1) {
         if (strncmp(argv[1], "--scale=", 8) == 0) {
             float scale = atof(argv[1] + 8);
@@ -108,37 +119,32 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    unsigned int maxTestIters = std::max(test_iterations[0], std::max(test_iterations[1], test_iterations[2]));
-    double times[maxTestIters];
-
     float *Aserial[2], *Aispc[2], *Aimpala[2];
-    Aserial[0] = new float [Nx * Ny * Nz];
-    Aserial[1] = new float [Nx * Ny * Nz];
-    Aispc[0] = new float [Nx * Ny * Nz];
-    Aispc[1] = new float [Nx * Ny * Nz];
-    Aimpala[0] = new float [Nx * Ny * Nz];
-    Aimpala[1] = new float [Nx * Ny * Nz];
-    float *vsq = new float [Nx * Ny * Nz];
+    Aserial[0] = numa_new<float>(Nx * Ny * Nz, false);
+    Aserial[1] = numa_new<float>(Nx * Ny * Nz, false);
+    Aispc[0] = numa_new<float>(Nx * Ny * Nz, false);
+    Aispc[1] = numa_new<float>(Nx * Ny * Nz, false);
+    Aimpala[0] = numa_new<float>(Nx * Ny * Nz, false);
+    Aimpala[1] = numa_new<float>(Nx * Ny * Nz, false);
+    float *vsq = numa_new<float>(Nx * Ny * Nz, false);
 
     float coeff[4] = { 0.5, -.25, .125, -.0625 };
 
-#define BENCH(iter, fn, res, name, bufs) \
-    double res; \
+#define BENCH(iter, fn, name, bufs) \
     InitData(Nx, Ny, Nz, bufs, vsq); \
-    for (unsigned int i = 0; i < iter; ++i) { \
-        reset_and_start_timer(); \
+    bench.run(name, iter, [&] { \
         fn(0, 6, width, Nx - width, width, Ny - width, width, Nz - width, Nx, Ny, Nz, coeff, vsq, bufs[0], bufs[1]); \
-        double dt = get_elapsed_mcycles(); \
-        printf("@time of " name " run:\t\t\t[%.3f] million cycles\n", dt); \
-        times[i] = dt; \
-    } \
-    res = median(times, iter); \
-    printf("[stencil " name "]:\t\t[%.3f] million cycles\n", res);
-
-    BENCH(test_iterations[0], loop_stencil_ispc,   timeISPC,   "ispc",   Aispc);
-    BENCH(test_iterations[1], loop_stencil_impala, timeImpala, "impala", Aimpala);
-    BENCH(test_iterations[2], loop_stencil_serial, timeSerial, "serial", Aserial);
-    printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n", timeSerial / timeISPC, timeSerial / timeImpala);
+    });
+
+    BENCH(test_iterations[0], loop_stencil_ispc,   "ispc",   Aispc);
+    BENCH(test_iterations[1], loop_stencil_impala, "impala", Aimpala);
+    BENCH(test_iterations[0], loop_stencil_ispc_tasks,   "ispc-tasks",   Aispc);
+    BENCH(test_iterations[1], loop_stencil_impala_tasks, "impala-tasks", Aimpala);
+    BENCH(test_iterations[2], loop_stencil_serial, "serial", Aserial);
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("serial", "ispc"), bench.speedup("serial", "impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("serial", "ispc-tasks"), bench.speedup("serial", "impala-tasks"));
 
     // Check for agreement
 #if 0
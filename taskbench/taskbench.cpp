@@ -0,0 +1,172 @@
+/*
+  Copyright (c) 2018, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Microbenchmarks for the task system the example was linked with:
+
+    launch N      latency of launching N empty tasks and waiting for them
+    tiny          throughput for a million tasks that do one store each,
+                  launched in batches of 64K since most task systems here
+                  keep per-task state for a whole launch
+    nested        outer tasks that each launch and sync inner empty tasks
+    balanced /    the same total work spread evenly over the tasks, or
+    imbalanced    concentrated in one task out of every 16
+
+  After the timed runs the launch, tiny and nested cases are repeated once
+  more and the number of heap allocations the task system made meanwhile
+  is printed; it should be zero for the task systems in tasksys.cpp, which
+  recycle their task groups and launch argument memory.
+
+  With CMake one executable per task system that builds on this platform
+  is produced (taskbench_pthreads, taskbench_omp, ...); the backend name
+  is part of the suite name, so the JSON or CSV reports of all of them
+  (--bench-format=...) can be concatenated and compared directly.
+*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#define NOMINMAX
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4305)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include "../bench.h"
+#include "taskbench_ispc.h"
+using namespace ispc;
+
+#if defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#define TASK_SYSTEM "pthreads_fully_subscribed"
+#elif defined ISPC_USE_PTHREADS
+#define TASK_SYSTEM "pthreads"
+#elif defined ISPC_USE_WORK_STEALING
+#define TASK_SYSTEM "work_stealing"
+#elif defined ISPC_USE_OMP
+#define TASK_SYSTEM "omp"
+#elif defined ISPC_USE_TBB_TASK_GROUP
+#define TASK_SYSTEM "tbb_task_group"
+#elif defined ISPC_USE_TBB_PARALLEL_FOR
+#define TASK_SYSTEM "tbb_parallel_for"
+#elif defined ISPC_USE_CILK
+#define TASK_SYSTEM "cilk"
+#elif defined ISPC_USE_HPX
+#define TASK_SYSTEM "hpx"
+#elif defined ISPC_USE_GCD
+#define TASK_SYSTEM "gcd"
+#elif defined ISPC_USE_CONCRT
+#define TASK_SYSTEM "concrt"
+#elif defined TASKBENCH_PORTABLE_OMP
+#define TASK_SYSTEM "portable_omp"
+#else
+#define TASK_SYSTEM "default"
+#endif
+
+// Provided by tasksys.cpp; task systems without it leave this NULL.
+#ifdef __GNUC__
+extern "C" int64_t ISPCHeapAllocations() __attribute__((weak));
+#else
+static int64_t (*ISPCHeapAllocations)() = NULL;
+#endif
+
+int main(int argc, char *argv[]) {
+    static const int taskCounts[] = { 1, 8, 64, 1024 };
+    // 0 leaves the number of runs to the benchmark harness
+    unsigned int runs = 0;
+    int launches = 1000;
+    int tinyTasks = 1 << 20, tinyBatch = 1 << 16;
+    int nestedOuter = 64, nestedInner = 64;
+    int workTasks = 1024, workIterations = 20000;
+
+    Bench bench("taskbench-" TASK_SYSTEM);
+    argc = bench.parseArgs(argc, argv);
+    if (argc > 1)
+        launches = std::max(1, atoi(argv[1]));
+    FILE *log = bench.logFile();
+
+    for (unsigned int i = 0; i < sizeof(taskCounts) / sizeof(taskCounts[0]); ++i) {
+        int count = taskCounts[i];
+        char name[32];
+        snprintf(name, sizeof(name), "launch %d", count);
+        BenchResult r = bench.run(name, runs, [&] {
+            for (int j = 0; j < launches; ++j)
+                launch_empty(count);
+        }, std::function<void()>(), launches);
+        fprintf(log, "\t\t\t\t(%.2f usec per launch+sync of %d tasks)\n",
+                r.metric("usec_per_op")->stats.median, count);
+    }
+
+    std::vector<int> tinyOut(tinyTasks);
+    BenchResult tiny = bench.run("tiny", runs, [&] {
+        for (int i = 0; i < tinyTasks; i += tinyBatch)
+            launch_tiny(tinyBatch, &tinyOut[i]);
+    }, [&] { std::fill(tinyOut.begin(), tinyOut.end(), -1); }, tinyTasks);
+    for (int i = 0; i < tinyTasks; ++i)
+        if (tinyOut[i] != i % tinyBatch) {
+            fprintf(stderr, "Task %d of %d didn't run\n", i, tinyTasks);
+            return 1;
+        }
+    fprintf(log, "\t\t\t\t(%.2f million tasks per second)\n",
+            1.0 / tiny.metric("usec_per_op")->stats.median);
+
+    BenchResult nested = bench.run("nested", runs, [&] {
+        launch_nested(nestedOuter, nestedInner);
+    }, std::function<void()>(), nestedOuter);
+    fprintf(log, "\t\t\t\t(%.2f usec per nested launch+sync of %d tasks, %d in parallel)\n",
+            nested.metric("usec_per_op")->stats.median, nestedInner, nestedOuter);
+
+    if (ISPCHeapAllocations != NULL) {
+        int64_t before = ISPCHeapAllocations();
+        for (unsigned int i = 0; i < sizeof(taskCounts) / sizeof(taskCounts[0]); ++i)
+            launch_empty(taskCounts[i]);
+        for (int i = 0; i < tinyTasks; i += tinyBatch)
+            launch_tiny(tinyBatch, &tinyOut[i]);
+        launch_nested(nestedOuter, nestedInner);
+        fprintf(log, "\t\t\t\t(%lld task system heap allocations in steady state)\n",
+                (long long)(ISPCHeapAllocations() - before));
+    }
+
+    std::vector<float> workOut(workTasks);
+    bench.run("balanced", runs, [&] {
+        launch_balanced(workTasks, workIterations, &workOut[0]);
+    });
+    bench.run("imbalanced", runs, [&] {
+        launch_imbalanced(workTasks, workIterations, &workOut[0]);
+    });
+    fprintf(log, "\t\t\t\t(imbalanced launch takes %.2fx the time of the balanced one)\n",
+            bench.speedup("imbalanced", "balanced"));
+
+    return 0;
+}
@@ -43,7 +43,8 @@
   There are several task systems in this file, built using:
     - Microsoft's Concurrency Runtime (ISPC_USE_CONCRT)
     - Apple's Grand Central Dispatch (ISPC_USE_GCD)
-    - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED)
+    - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED,
+      ISPC_USE_WORK_STEALING)
     - Cilk Plus (ISPC_USE_CILK)
     - TBB (ISPC_USE_TBB_TASK_GROUP, ISPC_USE_TBB_PARALLEL_FOR)
     - OpenMP (ISPC_USE_OMP)
@@ -59,15 +60,62 @@
 #define ISPC_USE_CONCRT
 #define ISPC_USE_PTHREADS
 #define ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#define ISPC_USE_WORK_STEALING
 #define ISPC_USE_CILK
 #define ISPC_USE_OMP
 #define ISPC_USE_TBB_TASK_GROUP
 #define ISPC_USE_TBB_PARALLEL_FOR
 
+  In the ISPC_USE_PTHREADS model a thread waiting in ISPCSync() runs the
+  tasks of the group it waits for that haven't started yet, and then those
+  of groups launched from more deeply nested tasks, so recursive
+  divide-and-conquer launches keep every thread busy at any depth without
+  deadlocking or growing the stack without bound.
+
   The ISPC_USE_PTHREADS_FULLY_SUBSCRIBED model essentially takes over the machine
   by assigning one pthread to each hyper-thread, and then uses spinlocks and atomics
   for task management.  This model is useful for KNC where tasks can take over
   the machine, but less so when there are other tasks that need running on the machine.
+  Every launch goes on a list of live launches that idle workers take task
+  indices from; a thread waiting in ISPCSync() runs the not yet started tasks
+  of its own launches itself, so nested launches don't deadlock.
+  Its workers are placed on the CPUs the process is allowed to use according to
+  the ISPC_TASKSYS_AFFINITY (compact, scatter, cores, none) and
+  ISPC_TASKSYS_THREADS environment variables.  A one-line summary of the
+  placement is printed to stderr at startup, and ISPC_TASKSYS_PLACEMENT=report
+  adds the CPU of every worker.  See TaskSys::createThreads().
+
+  The ISPC_USE_WORK_STEALING model gives every worker thread its own Chase-Lev
+  deque.  A launch pushes its whole task range as one item; whoever pops a range
+  splits it in halves (pushing the upper half back) until it is down to a batch
+  of tasks, which it then runs.  Idle workers steal the oldest (largest) ranges
+  from randomly chosen victims, so no global lock is taken on launch or sync.
+
+  These three models hand out the tasks of a launch in batches whose size
+  is tuned per launch site from the measured time per task, so that
+  launches of many tiny tasks don't pay for the queue once per task; the
+  ISPC_TASKSYS_GRAIN environment variable fixes the batch size or, set to
+  "report", prints every change.  See lGrainRecord().
+
+  Idle workers and waiting syncs of the ISPC_USE_PTHREADS and
+  ISPC_USE_PTHREADS_FULLY_SUBSCRIBED models spin briefly and then sleep on
+  a futex (on Linux) until they are woken; ISPC_TASKSYS_SPIN sets the number
+  of spin rounds.  taskbench/ measures the resulting launch/sync latency.
+
+  All models recycle their task groups (each thread keeps the last one it
+  synced, the rest go to a shared pool), together with the task queues and
+  the ISPCAlloc() arena of each group, so a program that launches the same
+  work over and over stops allocating after the first few launches.
+  ISPCHeapAllocations() returns how many heap allocations the task system
+  has made, which taskbench/ uses to check this.
+
+  Defining ISPC_TASKSYS_TRACE makes every thread record when it runs which
+  task (group and index), how long it spins and sleeps while idle, and, where
+  the model has them, its steals and queue depths.  At exit the events are
+  written as a Chrome trace (chrome://tracing, Perfetto) to the file named
+  by the ISPC_TASKSYS_TRACE environment variable, tasksys-trace.json by
+  default, and a table of per-thread utilization is printed to stderr.
+  Without the define none of this is compiled in.
 
 #define ISPC_USE_CREW
 #define ISPC_USE_HPX
@@ -81,6 +129,7 @@
 
 #if !(defined ISPC_USE_CONCRT          || defined ISPC_USE_GCD              || \
       defined ISPC_USE_PTHREADS        || defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED || \
+      defined ISPC_USE_WORK_STEALING   || \
       defined ISPC_USE_TBB_TASK_GROUP  || defined ISPC_USE_TBB_PARALLEL_FOR || \
       defined ISPC_USE_OMP             || defined ISPC_USE_CILK             || \
       defined ISPC_USE_HPX)
@@ -110,9 +159,21 @@
 #define ISPC_IS_KNC
 #endif
 
+#ifdef ISPC_IS_WINDOWS
+#define ISPC_THREAD_LOCAL __declspec(thread)
+#else
+#define ISPC_THREAD_LOCAL __thread
+#endif
+
 
 #define DBG(x)
 
+#ifdef ISPC_TASKSYS_TRACE
+#define TRACE(x) x
+#else
+#define TRACE(x)
+#endif
+
 #ifdef ISPC_IS_WINDOWS
   #define NOMINMAX
   #include <windows.h>
@@ -134,7 +195,7 @@
   #include <sys/types.h>
   #include <sys/stat.h>
   #include <sys/param.h>
-  #include <sys/sysctl.h>
+  #include <limits.h>
   #include <vector>
   #include <algorithm>
 #endif // ISPC_USE_PTHREADS
@@ -147,12 +208,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
-#include <sys/sysctl.h>
+#include <sched.h>
+#include <dirent.h>
+#include <limits.h>
 #include <vector>
 #include <algorithm>
-//#include <stdexcept>
-#include <stack>
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#if (defined ISPC_USE_PTHREADS || defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED) && defined ISPC_IS_LINUX
+  #include <sched.h>
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+#ifdef ISPC_USE_WORK_STEALING
+  #include <pthread.h>
+  #include <unistd.h>
+  #include <errno.h>
+  #include <time.h>
+  #include <atomic>
+  #include <vector>
+#endif // ISPC_USE_WORK_STEALING
 #ifdef ISPC_USE_TBB_PARALLEL_FOR
   #include <tbb/parallel_for.h>
 #endif // ISPC_USE_TBB_PARALLEL_FOR
@@ -172,6 +246,10 @@
 #ifdef ISPC_IS_LINUX
   #include <malloc.h>
 #endif // ISPC_IS_LINUX
+#ifdef ISPC_TASKSYS_TRACE
+  #include <errno.h>
+  #include <vector>
+#endif // ISPC_TASKSYS_TRACE
 
 #include <stdio.h>
 #include <stdint.h>
@@ -179,6 +257,7 @@
 #include <assert.h>
 #include <string.h>
 #include <algorithm>
+#include <chrono>
 
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
@@ -226,8 +305,16 @@ extern "C" {
     void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
     void ISPCSync(void *handle);
+
+    // Number of heap allocations the task system has made so far.  Task
+    // groups, their task queues and ISPCAlloc() memory are all recycled,
+    // so this should stop growing once an application reaches steady state.
+    int64_t ISPCHeapAllocations();
 }
 
+// Called wherever the task system itself allocates from the heap.
+static inline void lCountHeapAllocation();
+
 ///////////////////////////////////////////////////////////////////////////
 // TaskGroupBase
 
@@ -336,8 +423,10 @@ TaskGroupBase::GetTaskInfo(int index) {
         exit(1);
     }
 
-    if (taskInfo[chunk] == NULL)
+    if (taskInfo[chunk] == NULL) {
+        lCountHeapAllocation();
         taskInfo[chunk] = new TaskInfo[TASK_QUEUE_CHUNK_SIZE];
+    }
     return &taskInfo[chunk][offset];
 }
 
@@ -358,11 +447,16 @@ TaskGroupBase::AllocMemory(int64_t size, int32_t alignment) {
     curMemBufferOffset = 0;
     assert(curMemBuffer < NUM_MEM_BUFFERS);
 
+    // Buffers stay with the group when it is reset, so a recycled group
+    // only goes to the heap if a launch needs more than it did before.
     int allocSize = 1 << (12 + curMemBuffer);
     allocSize = std::max(int(size+alignment), allocSize);
-    char *newBuf = new char[allocSize];
-    memBufferSize[curMemBuffer] = allocSize;
-    memBuffers[curMemBuffer] = newBuf;
+    if (memBufferSize[curMemBuffer] < allocSize) {
+        delete[](memBuffers[curMemBuffer]);
+        lCountHeapAllocation();
+        memBuffers[curMemBuffer] = new char[allocSize];
+        memBufferSize[curMemBuffer] = allocSize;
+    }
     return AllocMemory(size, alignment);
 }
 
@@ -410,6 +504,447 @@ lAtomicAdd(volatile int32_t *v, int32_t delta) {
 #endif
 }
 
+// Returns the old value on all platforms
+static inline int64_t
+lAtomicAdd64(volatile int64_t *v, int64_t delta) {
+#ifdef ISPC_IS_WINDOWS
+    return InterlockedExchangeAdd64((volatile LONGLONG *)v, delta);
+#else
+    return __sync_fetch_and_add(v, delta);
+#endif
+}
+
+static volatile int32_t lNumHeapAllocations = 0;
+
+static inline void
+lCountHeapAllocation() {
+    lAtomicAdd(&lNumHeapAllocations, 1);
+}
+
+int64_t
+ISPCHeapAllocations() {
+    return lNumHeapAllocations;
+}
+
+static inline void
+lPause() {
+#if defined ISPC_IS_KNC
+    _mm_delay_32(8);
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Monotonic time in nanoseconds
+static inline int64_t
+lNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Tracing
+//
+// Each thread appends to its own buffer, so recording an event is a clock
+// read and a store.  The buffers are linked into a global list the first
+// time a thread records something and are only read by the atexit handler,
+// by which time the program has synced all of its launches.
+
+#ifdef ISPC_TASKSYS_TRACE
+
+enum TraceKind {
+    TRACE_TASK,  // ran task 'index' of 'group'
+    TRACE_SPIN,  // busy-waited for work or for a sync
+    TRACE_PARK,  // slept for work or for a sync
+    TRACE_STEAL, // took work queued by thread/node 'index'
+    TRACE_QUEUE  // 'index' tasks, ranges or launches (depending on the
+                 // model) were queued after a launch or split
+};
+
+struct TraceEvent {
+    int64_t begin, end; // ns since the first event
+    const void *group;
+    int32_t index;
+    int32_t kind;
+};
+
+// Events beyond this many per thread are only counted in the summary
+#define MAX_TRACE_EVENTS (1 << 20)
+
+struct TraceBuffer {
+    char name[32];
+    std::vector<TraceEvent> events;
+    int64_t time[TRACE_QUEUE]; // ns per kind, TRACE_TASK..TRACE_PARK
+    int64_t count[TRACE_QUEUE + 1];
+    int32_t maxQueue;
+    TraceBuffer *next;
+};
+
+static TraceBuffer *lTraceBuffers = NULL;
+static volatile int32_t lNumTraceBuffers = 0;
+static ISPC_THREAD_LOCAL TraceBuffer *lTraceBuffer = NULL;
+
+static inline int64_t
+lTraceNow() {
+    static const int64_t start = lNanoseconds();
+    return lNanoseconds() - start;
+}
+
+static void lTraceWrite();
+
+static TraceBuffer *
+lTraceThread() {
+    TraceBuffer *buf = lTraceBuffer;
+    if (buf != NULL)
+        return buf;
+
+    buf = new TraceBuffer;
+    int32_t id = lAtomicAdd(&lNumTraceBuffers, 1);
+    snprintf(buf->name, sizeof(buf->name), "thread %d", (int)id);
+    buf->events.reserve(4096);
+    memset(buf->time, 0, sizeof(buf->time));
+    memset(buf->count, 0, sizeof(buf->count));
+    buf->maxQueue = 0;
+    do {
+        buf->next = lTraceBuffers;
+    } while (lAtomicCompareAndSwapPointer((void **)&lTraceBuffers, buf, buf->next) != buf->next);
+    if (id == 0)
+        atexit(lTraceWrite);
+    lTraceBuffer = buf;
+    return buf;
+}
+
+/* Names the calling thread in the trace, e.g. "worker 3". */
+static inline void
+lTraceName(const char *prefix, int index) {
+    TraceBuffer *buf = lTraceThread();
+    snprintf(buf->name, sizeof(buf->name), "%s %d", prefix, index);
+}
+
+static inline void
+lTraceEvent(TraceKind kind, int64_t begin, int64_t end, const void *group, int index) {
+    TraceBuffer *buf = lTraceThread();
+    if (kind < TRACE_STEAL)
+        buf->time[kind] += end - begin;
+    buf->count[kind]++;
+    if (kind == TRACE_QUEUE)
+        buf->maxQueue = std::max(buf->maxQueue, (int32_t)index);
+    if (buf->events.size() < MAX_TRACE_EVENTS) {
+        TraceEvent e = { begin, end, group, index, kind };
+        buf->events.push_back(e);
+    }
+}
+
+static inline void
+lTraceTask(const void *group, int index, int64_t begin) {
+    lTraceEvent(TRACE_TASK, begin, lTraceNow(), group, index);
+}
+
+static inline void
+lTraceIdle(TraceKind kind, int64_t begin) {
+    lTraceEvent(kind, begin, lTraceNow(), NULL, 0);
+}
+
+static inline void
+lTraceSteal(int victim) {
+    int64_t now = lTraceNow();
+    lTraceEvent(TRACE_STEAL, now, now, NULL, victim);
+}
+
+static inline void
+lTraceQueue(int depth) {
+    int64_t now = lTraceNow();
+    lTraceEvent(TRACE_QUEUE, now, now, NULL, depth);
+}
+
+static void
+lTraceWrite() {
+    const char *path = getenv("ISPC_TASKSYS_TRACE");
+    if (path == NULL || *path == '\0')
+        path = "tasksys-trace.json";
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "tasksys: can't write trace to %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    std::vector<TraceBuffer *> threads;
+    for (TraceBuffer *buf = lTraceBuffers; buf != NULL; buf = buf->next)
+        threads.insert(threads.begin(), buf);
+
+    int64_t first = INT64_MAX, last = 0, numEvents = 0;
+    for (size_t t = 0; t < threads.size(); ++t)
+        for (size_t i = 0; i < threads[t]->events.size(); ++i) {
+            first = std::min(first, threads[t]->events[i].begin);
+            last = std::max(last, threads[t]->events[i].end);
+        }
+
+    static const char *names[] = { "task", "spin", "park", "steal", "queue depth" };
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    const char *sep = "";
+    for (size_t t = 0; t < threads.size(); ++t) {
+        TraceBuffer *buf = threads[t];
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", sep, (int)t, buf->name);
+        sep = ",\n";
+        for (size_t i = 0; i < buf->events.size(); ++i) {
+            const TraceEvent &e = buf->events[i];
+            double ts = (e.begin - first) * 1e-3, dur = (e.end - e.begin) * 1e-3;
+            switch (e.kind) {
+            case TRACE_TASK:
+                fprintf(f, "%s{\"name\":\"task\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+                        "\"dur\":%.3f,\"args\":{\"group\":\"%p\",\"index\":%d}}",
+                        sep, (int)t, ts, dur, e.group, e.index);
+                break;
+            case TRACE_SPIN:
+            case TRACE_PARK:
+                fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+                        "\"dur\":%.3f}", sep, names[e.kind], (int)t, ts, dur);
+                break;
+            case TRACE_STEAL:
+                fprintf(f, "%s{\"name\":\"steal\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%d,"
+                        "\"ts\":%.3f,\"args\":{\"victim\":%d}}", sep, (int)t, ts, e.index);
+                break;
+            case TRACE_QUEUE:
+                fprintf(f, "%s{\"name\":\"queue depth (%s)\",\"ph\":\"C\",\"pid\":0,\"tid\":%d,"
+                        "\"ts\":%.3f,\"args\":{\"tasks\":%d}}", sep, buf->name, (int)t, ts, e.index);
+                break;
+            }
+            ++numEvents;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    double span = last > first ? (double)(last - first) : 1.0;
+    fprintf(stderr, "tasksys: %lld trace events over %.3f ms written to %s\n",
+            (long long)numEvents, span * 1e-6, path);
+    fprintf(stderr, "%-12s %10s %10s %10s %10s %8s %9s %6s\n", "thread", "tasks",
+            "busy ms", "spin ms", "park ms", "steals", "max queue", "util");
+    for (size_t t = 0; t < threads.size(); ++t) {
+        TraceBuffer *buf = threads[t];
+        fprintf(stderr, "%-12s %10lld %10.3f %10.3f %10.3f %8lld %9d %5.1f%%\n", buf->name,
+                (long long)buf->count[TRACE_TASK], buf->time[TRACE_TASK] * 1e-6,
+                buf->time[TRACE_SPIN] * 1e-6, buf->time[TRACE_PARK] * 1e-6,
+                (long long)buf->count[TRACE_STEAL], (int)buf->maxQueue,
+                100.0 * buf->time[TRACE_TASK] / span);
+    }
+}
+
+#endif // ISPC_TASKSYS_TRACE
+
+///////////////////////////////////////////////////////////////////////////
+// Task granularity tuning
+//
+// The task count of a launch is fixed by the ispc code, and what one task
+// costs depends on the machine and the input.  The pthreads, work stealing
+// and fully subscribed models therefore hand out tasks in batches: every
+// launch site (identified by its task function) keeps a running average of
+// the time per task, measured over the batches that ran, from which the
+// batch size is chosen so that a batch takes about TARGET_BATCH_NS, which
+// amortizes the cost of taking work from the queue.  A launch is still
+// split into at least MIN_BATCHES_PER_THREAD batches per thread so that
+// the load stays balanced; so the tuner coalesces small tasks but never
+// makes a launch coarser than its author allowed.
+//
+// The batch size of each site is kept across launches.  It is a power of
+// two and only changes once enough tasks have been measured, which keeps
+// it from oscillating.  The ISPC_TASKSYS_GRAIN environment variable
+// selects the behavior:
+//
+//   auto     (default) tune as described above
+//   report   tune, and print every change of a site's batch size to stderr
+//   <n>      always use batches of n tasks (1 is one task at a time, as
+//            without tuning)
+
+#if defined ISPC_USE_PTHREADS || defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED || \
+    defined ISPC_USE_WORK_STEALING
+
+#define TARGET_BATCH_NS 20000
+#define MIN_BATCHES_PER_THREAD 4
+#define MAX_GRAIN 1024
+#define NUM_GRAIN_SITES 256
+
+struct GrainSite {
+    void *func;
+    volatile int32_t grain;
+    volatile int32_t updating;
+    volatile int64_t ns, tasks; // measured since the last update
+};
+
+static GrainSite lGrainSites[NUM_GRAIN_SITES];
+
+// 0 for auto, -1 for report, otherwise the fixed batch size
+static int
+lGrainMode() {
+    static volatile int32_t mode = -2;
+    if (mode == -2) {
+        const char *env = getenv("ISPC_TASKSYS_GRAIN");
+        int m = 0;
+        if (env != NULL && strcmp(env, "report") == 0)
+            m = -1;
+        else if (env != NULL && atoi(env) > 0)
+            m = std::min(atoi(env), MAX_GRAIN);
+        mode = m;
+    }
+    return mode;
+}
+
+/* Returns the entry for the given task function, or NULL if the table is
+   full. */
+static GrainSite *
+lGrainSite(void *func) {
+    uint64_t h = (uint64_t)(uintptr_t)func;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < NUM_GRAIN_SITES; ++i) {
+        GrainSite *site = &lGrainSites[(h + i) % NUM_GRAIN_SITES];
+        void *f = site->func;
+        if (f == func)
+            return site;
+        if (f == NULL) {
+            f = lAtomicCompareAndSwapPointer(&site->func, func, NULL);
+            if (f == NULL || f == func) {
+                if (f == NULL)
+                    site->grain = 1;
+                return site;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Batch size for a launch of count tasks of the given site, run by
+   numThreads threads. */
+static inline int
+lGrain(GrainSite *site, int count, int numThreads) {
+    int mode = lGrainMode();
+    if (mode > 0)
+        return mode;
+    int grain = site != NULL ? std::max(1, (int)site->grain) : 1;
+    return std::max(1, std::min(grain, count / (MIN_BATCHES_PER_THREAD * numThreads)));
+}
+
+/* Accounts a batch of the given number of tasks that took ns. */
+static inline void
+lGrainRecord(GrainSite *site, int tasks, int64_t ns) {
+    if (site == NULL || lGrainMode() > 0)
+        return;
+    lAtomicAdd64(&site->ns, ns);
+    int64_t measured = lAtomicAdd64(&site->tasks, tasks) + tasks;
+    int grain = site->grain;
+    if (measured < 128 + 16 * (int64_t)grain || site->updating ||
+        lAtomicCompareAndSwap32(&site->updating, 1, 0) != 0)
+        return;
+
+    // The smallest power of two whose batches take at least the target
+    // time; batches between half and twice the target are left alone.
+    double nsPerTask = (double)site->ns / (double)std::max((int64_t)site->tasks, (int64_t)1);
+    double batchNs = grain * nsPerTask;
+    int ideal = 1;
+    while (ideal < MAX_GRAIN && ideal * nsPerTask < TARGET_BATCH_NS)
+        ideal *= 2;
+    if (ideal != grain && (batchNs < TARGET_BATCH_NS / 2 || batchNs > 2 * TARGET_BATCH_NS)) {
+        if (lGrainMode() < 0)
+            fprintf(stderr, "tasksys: launch site %p: %.3f usec per task, batches of %d tasks "
+                    "(was %d)\n", site->func, nsPerTask * 1e-3, ideal, grain);
+        site->grain = ideal;
+    }
+    // Halve rather than clear the counts, so that the estimate is a
+    // decaying average over the recent launches and a single batch that
+    // was descheduled doesn't flip the size back and forth.  Other
+    // threads keep adding to the counts meanwhile, so subtract the halves
+    // atomically instead of storing the halved values.
+    lAtomicAdd64(&site->ns, -(site->ns / 2));
+    lAtomicAdd64(&site->tasks, -(site->tasks / 2));
+    lMemFence();
+    site->updating = 0;
+}
+
+#endif // ISPC_USE_PTHREADS || ISPC_USE_PTHREADS_FULLY_SUBSCRIBED || ISPC_USE_WORK_STEALING
+
+///////////////////////////////////////////////////////////////////////////
+// Spin-then-park waiting
+//
+// A waiter first spins on its condition for a bounded number of pause
+// rounds, which covers short tasks without a system call on either side,
+// and then sleeps on a futex word.  Whoever may make the condition true
+// changes the word first and then issues the wake-up call, but only if a
+// waiter has registered itself as parked.  The spin budget can be set with
+// the ISPC_TASKSYS_SPIN environment variable (0 parks right away); it
+// defaults to 0 when the process may only use a single CPU, since the
+// thread we'd be waiting for can't make progress while we spin.
+
+#if defined ISPC_USE_PTHREADS || defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
+#define DEFAULT_SPIN_ROUNDS 2048
+
+static int
+lSpinRounds() {
+    static volatile int32_t rounds = -1;
+    if (rounds < 0) {
+        const char *env = getenv("ISPC_TASKSYS_SPIN");
+        if (env != NULL && atoi(env) >= 0) {
+            rounds = atoi(env);
+        } else {
+            int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef ISPC_IS_LINUX
+            cpu_set_t mask;
+            if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+                ncpus = CPU_COUNT(&mask);
+#endif
+            rounds = ncpus > 1 ? DEFAULT_SPIN_ROUNDS : 0;
+        }
+    }
+    return rounds;
+}
+
+// Sleeps while *word == value; may return spuriously.
+static inline void
+lParkOn(volatile int32_t *word, int32_t value) {
+#ifdef ISPC_IS_LINUX
+    syscall(SYS_futex, (int32_t *)word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+    if (*word == value)
+        usleep(1);
+#endif
+}
+
+static inline void
+lUnparkAll(volatile int32_t *word) {
+#ifdef ISPC_IS_LINUX
+    syscall(SYS_futex, (int32_t *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+// Waits until done() holds.  Anyone who may make done() true must modify
+// *word afterwards and call lUnparkAll(word) if *parked is nonzero.
+template <typename Done> static inline void
+lSpinThenPark(volatile int32_t *word, volatile int32_t *parked, Done done) {
+    TRACE(int64_t spinStart = lTraceNow());
+    for (int i = 0, n = lSpinRounds(); i < n; ++i) {
+        if (done()) {
+            TRACE(if (i > 0) lTraceIdle(TRACE_SPIN, spinStart));
+            return;
+        }
+        lPause();
+    }
+    TRACE(lTraceIdle(TRACE_SPIN, spinStart));
+    TRACE(int64_t parkStart = lTraceNow());
+    while (!done()) {
+        int32_t value = *word;
+        lAtomicAdd(parked, 1);
+        if (!done())
+            lParkOn(word, value);
+        lAtomicAdd(parked, -1);
+    }
+    TRACE(lTraceIdle(TRACE_PARK, parkStart));
+}
+
+#endif // ISPC_USE_PTHREADS || ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
 ///////////////////////////////////////////////////////////////////////////
 
 #ifdef ISPC_USE_CONCRT
@@ -442,6 +977,9 @@ private:
 
 #ifdef ISPC_USE_PTHREADS
 static void *lTaskEntry(void *arg);
+class TaskGroup;
+static inline void lTaskFinished(TaskGroup *tg, int count);
+static int lTakeBatch(TaskGroup *tg, int *batch, GrainSite **site);
 
 class TaskGroup : public TaskGroupBase {
 public:
@@ -449,12 +987,14 @@ public:
         numUnfinishedTasks = 0;
         waitingTasks.reserve(128);
         inActiveList = false;
+        depth = -1;
     }
 
     void Reset() {
         TaskGroupBase::Reset();
         numUnfinishedTasks = 0;
         assert(inActiveList == false);
+        depth = -1;
         lMemFence();
     }
 
@@ -463,15 +1003,40 @@ public:
 
 private:
     friend void *lTaskEntry(void *arg);
+    friend void lTaskFinished(TaskGroup *tg, int count);
+    friend int lTakeBatch(TaskGroup *tg, int *batch, GrainSite **site);
 
     int32_t numUnfinishedTasks;
     int32_t pad[3];
     std::vector<int> waitingTasks;
     bool inActiveList;
+    // Number of tasks that were running on the launching thread's stack
+    // when the group was first launched; 0 for launches from outside of
+    // tasks.
+    int depth;
 };
 
 #endif // ISPC_USE_PTHREADS
 
+#ifdef ISPC_USE_WORK_STEALING
+
+class TaskGroup : public TaskGroupBase {
+public:
+    TaskGroup() : numUnfinishedTasks(0) {}
+
+    void Reset() {
+        TaskGroupBase::Reset();
+        numUnfinishedTasks.store(0, std::memory_order_relaxed);
+    }
+
+    void Launch(int baseIndex, int count);
+    void Sync();
+
+    std::atomic<int32_t> numUnfinishedTasks;
+};
+
+#endif // ISPC_USE_WORK_STEALING
+
 #ifdef ISPC_USE_CILK
 
 class TaskGroup : public TaskGroupBase {
@@ -570,10 +1135,12 @@ lRunTask(void *ti) {
     int threadCount = 1;
 
     // Actually run the task
+    TRACE(int64_t taskStart = lTraceNow());
     taskInfo->func(taskInfo->data, threadIndex, threadCount,
                    taskInfo->taskIndex, taskInfo->taskCount(),
             taskInfo->taskIndex0(), taskInfo->taskIndex1(), taskInfo->taskIndex2(),
             taskInfo->taskCount0(), taskInfo->taskCount1(), taskInfo->taskCount2());
+    TRACE(lTraceTask(NULL, taskInfo->taskIndex, taskStart));
 }
 
 
@@ -614,9 +1181,11 @@ lRunTask(LPVOID param) {
     // will cause bugs in code that uses those.
     int threadIndex = 0;
     int threadCount = 1;
+    TRACE(int64_t taskStart = lTraceNow());
     ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+    TRACE(lTraceTask(NULL, ti->taskIndex, taskStart));
 
     // Signal the event that this task is done
     ti->taskEvent.set();
@@ -655,18 +1224,120 @@ static pthread_mutex_t taskSysMutex;
 static std::vector<TaskGroup *> activeTaskGroups;
 static sem_t *workerSemaphore;
 
+// Bumped whenever a task group's last task finishes and whenever tasks are
+// launched; threads in TaskGroup::Sync() that have nothing left to run park
+// on it.
+static volatile int32_t syncEpoch = 0;
+static volatile int32_t numParkedSyncs = 0;
+
+// Index of a worker thread (0..nThreads-1); other threads run tasks as
+// thread nThreads.
+static __thread int lWorkerIndex = -1;
+// Tasks currently running on this thread's stack
+static __thread int lTaskDepth = 0;
+
+static inline void
+lRunTask(TaskGroup *tg, TaskInfo *ti) {
+    int threadIndex = lWorkerIndex >= 0 ? lWorkerIndex : nThreads;
+    ++lTaskDepth;
+    TRACE(int64_t taskStart = lTraceNow());
+    ti->func(ti->data, threadIndex, nThreads + 1, ti->taskIndex, ti->taskCount(),
+             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
+             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+    TRACE(lTraceTask(tg, ti->taskIndex, taskStart));
+    (void)tg;
+    --lTaskDepth;
+}
+
+// Spins on the semaphore for a while before blocking in sem_wait(), so that
+// back-to-back launches don't pay for a futex wake-up each.
+static int
+lWaitForWork() {
+    TRACE(int64_t spinStart = lTraceNow());
+    for (int i = 0, n = lSpinRounds(); i < n; ++i) {
+        if (sem_trywait(workerSemaphore) == 0) {
+            TRACE(if (i > 0) lTraceIdle(TRACE_SPIN, spinStart));
+            return 0;
+        }
+        lPause();
+    }
+    TRACE(lTraceIdle(TRACE_SPIN, spinStart));
+    TRACE(int64_t parkStart = lTraceNow());
+    int err = sem_wait(workerSemaphore);
+    TRACE(lTraceIdle(TRACE_PARK, parkStart));
+    return err;
+}
+
+static inline void
+lTaskFinished(TaskGroup *tg, int count) {
+    lMemFence();
+    if (lAtomicAdd(&tg->numUnfinishedTasks, -count) == count) {
+        // tg may be recycled as soon as its counter is zero; only touch
+        // the global wake-up state from here on.
+        lAtomicAdd(&syncEpoch, 1);
+        if (numParkedSyncs > 0)
+            lUnparkAll(&syncEpoch);
+    }
+}
+
+/* Takes a batch of tasks of the launch whose tasks are at the end of tg's
+   waiting list, sized by the launch site's granularity tuner, and removes
+   tg from the active list if that was the last of them.  Callers hold
+   taskSysMutex.  Returns the number of tasks taken. */
+static int
+lTakeBatch(TaskGroup *tg, int *batch, GrainSite **site) {
+    TaskFuncType func = tg->GetTaskInfo(tg->waitingTasks.back())->func;
+    *site = lGrainSite((void *)func);
+    int grain = lGrain(*site, tg->GetTaskInfo(tg->waitingTasks.back())->taskCount(), nThreads + 1);
+    int n = 0;
+    do {
+        batch[n++] = tg->waitingTasks.back();
+        tg->waitingTasks.pop_back();
+    } while (n < grain && tg->waitingTasks.size() > 0 &&
+             tg->GetTaskInfo(tg->waitingTasks.back())->func == func);
+
+    if (tg->waitingTasks.size() == 0) {
+        // There's nothing left to start running from this group, so
+        // remove it from the active task list.
+        activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
+                                         activeTaskGroups.end(), tg));
+        tg->inActiveList = false;
+    }
+    return n;
+}
+
+static void
+lRunBatch(TaskGroup *tg, const int *batch, int count, GrainSite *site) {
+    int64_t start = lNanoseconds();
+    for (int i = 0; i < count; ++i) {
+        DBG(fprintf(stderr, "running task %d from group %p\n", batch[i], tg));
+        lRunTask(tg, tg->GetTaskInfo(batch[i]));
+    }
+    lGrainRecord(site, count, lNanoseconds() - start);
+
+    //
+    // Decrement the "number of unfinished tasks" counter in the task
+    // group.
+    //
+    lTaskFinished(tg, count);
+}
+
 static void *
 lTaskEntry(void *arg) {
-    int threadIndex = (int)((int64_t)arg);
-    int threadCount = nThreads;
+    lWorkerIndex = (int)((int64_t)arg);
+    TRACE(lTraceName("worker", lWorkerIndex));
 
+    int batch[MAX_GRAIN];
+    bool idle = true;
     while (1) {
         int err;
         //
         // Wait on the semaphore until we're woken up due to the arrival of
-        // more work.
+        // more work.  Launches only wake as many workers as they have
+        // tasks, so after running a batch we come back for more without
+        // waiting until the queue is empty.
         //
-        if ((err = sem_wait(workerSemaphore)) != 0) {
+        if (idle && (err = lWaitForWork()) != 0) {
             fprintf(stderr, "Error from sem_wait: %s\n", strerror(err));
             exit(1);
         }
@@ -687,24 +1358,18 @@ lTaskEntry(void *arg) {
                 fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
                 exit(1);
             }
+            idle = true;
             continue;
         }
 
         //
-        // Get the last task group on the active list and the last task
-        // from its waiting tasks list.
+        // Get the last task group on the active list and a batch of tasks
+        // from the end of its waiting tasks list.
         //
         TaskGroup *tg = activeTaskGroups.back();
         assert(tg->waitingTasks.size() > 0);
-        int taskNumber = tg->waitingTasks.back();
-        tg->waitingTasks.pop_back();
-
-        if (tg->waitingTasks.size() == 0) {
-            // We just took the last task from this task group, so remove
-            // it from the active list.
-            activeTaskGroups.pop_back();
-            tg->inActiveList = false;
-        }
+        GrainSite *site;
+        int count = lTakeBatch(tg, batch, &site);
 
         if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
             fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
@@ -712,21 +1377,10 @@ lTaskEntry(void *arg) {
         }
 
         //
-        // And now actually run the task
+        // And now actually run the tasks
         //
-        DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
-        TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
-        myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
-                     myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
-
-        //
-        // Decrement the "number of unfinished tasks" counter in the task
-        // group.
-        //
-        lMemFence();
-        lAtomicAdd(&tg->numUnfinishedTasks, -1);
+        lRunBatch(tg, batch, count, site);
+        idle = false;
     }
 
     pthread_exit(NULL);
@@ -812,6 +1466,9 @@ TaskGroup::Launch(int baseCoord, int count) {
     // per-TaskGroup mutex showed worse performance!)
     for (int i = 0; i < count; ++i)
         waitingTasks.push_back(baseCoord + i);
+    TRACE(lTraceQueue((int)waitingTasks.size()));
+    if (depth < 0)
+        depth = lTaskDepth;
 
     // Add the task group to the global active list if it isn't there
     // already.
@@ -832,11 +1489,17 @@ TaskGroup::Launch(int baseCoord, int count) {
     lMemFence();
     lAtomicAdd(&numUnfinishedTasks, count);
 
+    // Threads parked in Sync() may be able to help with these.
+    lAtomicAdd(&syncEpoch, 1);
+    if (numParkedSyncs > 0)
+        lUnparkAll(&syncEpoch);
+
     //
     // Post to the worker semaphore to wake up worker threads that are
-    // sleeping waiting for tasks to show up
+    // sleeping waiting for tasks to show up; each keeps taking batches
+    // until the queue is empty.
     //
-    for (int i = 0; i < count; ++i)
+    for (int i = 0; i < std::min(count, nThreads); ++i)
         if ((err = sem_post(workerSemaphore)) != 0) {
             fprintf(stderr, "Error from sem_post: %s\n", strerror(err));
             exit(1);
@@ -848,10 +1511,16 @@ inline void
 TaskGroup::Sync() {
     DBG(fprintf(stderr, "syncing %p - %d unfinished\n", tg, numUnfinishedTasks));
 
+    // While our tasks aren't finished we run tasks ourselves: our own
+    // group's first, and then those of groups launched by tasks nested
+    // more deeply than we are, which are what our running tasks wait for.
+    // Tasks of shallower groups are left alone: one of them could run for
+    // much longer than what we are waiting for, and taking them would let
+    // a chain of unrelated syncs pile up on this thread's stack.  With that,
+    // recursive launches of any depth neither deadlock nor overflow the
+    // stack, and a thread only idles when every task it could help with is
+    // already running.
     while (numUnfinishedTasks > 0) {
-        // All of the tasks in this group aren't finished yet.  We'll try
-        // to help out here since we don't have anything else to do...
-
         DBG(fprintf(stderr, "while syncing %p - %d unfinished\n", tg,
                     numUnfinishedTasks));
 
@@ -863,87 +1532,507 @@ TaskGroup::Sync() {
             fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
             exit(1);
         }
+        int32_t epoch = syncEpoch;
 
-        TaskInfo *myTask = NULL;
-        TaskGroup *runtg = this;
-        if (waitingTasks.size() > 0) {
-            int taskNumber = waitingTasks.back();
-            waitingTasks.pop_back();
-
-            if (waitingTasks.size() == 0) {
-                // There's nothing left to start running from this group,
-                // so remove it from the active task list.
-                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
-                                                 activeTaskGroups.end(), this));
-                inActiveList = false;
-            }
-            myTask = GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from group %p in sync\n", taskNumber, tg));
-        }
+        TaskGroup *runtg = NULL;
+        if (waitingTasks.size() > 0)
+            runtg = this;
         else {
             // Other threads are already working on all of the tasks in
-            // this group, so we can't help out by running one ourself.
-            // We'll try to run one from another group to make ourselves
-            // useful here.
-            if (activeTaskGroups.size() == 0) {
-                // No active task groups left--there's nothing for us to do.
-                if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                    fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                    exit(1);
+            // this group; look for the most recently activated group
+            // that is nested deeper than we are.
+            for (int i = (int)activeTaskGroups.size() - 1; i >= 0; --i)
+                if (activeTaskGroups[i]->depth > depth) {
+                    runtg = activeTaskGroups[i];
+                    break;
                 }
-                // FIXME: We basically end up busy-waiting here, which is
-                // extra wasteful in a world with hyper-threading.  It would
-                // be much better to put this thread to sleep on a
-                // condition variable that was signaled when the last task
-                // in this group was finished.
-#ifndef ISPC_IS_KNC
-                usleep(1);
-#else
-                _mm_delay_32(8);
-#endif
-                continue;
-            }
+        }
 
-            // Get a task to run from another task group.
-            runtg = activeTaskGroups.back();
-            assert(runtg->waitingTasks.size() > 0);
-
-            int taskNumber = runtg->waitingTasks.back();
-            runtg->waitingTasks.pop_back();
-            if (runtg->waitingTasks.size() == 0) {
-                // There's left to start running from this group, so remove
-                // it from the active task list.
-                activeTaskGroups.pop_back();
-                runtg->inActiveList = false;
+        if (runtg == NULL) {
+            // Nothing we can help with.
+            if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
+                fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+                exit(1);
             }
-            myTask = runtg->GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from other group %p in sync\n",
-                        taskNumber, runtg));
+            // Spin for a bit, then sleep until the last task of this
+            // group has finished or something new has been launched.
+            lSpinThenPark(&syncEpoch, &numParkedSyncs, [this, epoch] {
+                return *(volatile int32_t *)&numUnfinishedTasks == 0 || syncEpoch != epoch;
+            });
+            continue;
         }
 
+        assert(runtg->waitingTasks.size() > 0);
+        int batch[MAX_GRAIN];
+        GrainSite *site;
+        int count = lTakeBatch(runtg, batch, &site);
+        DBG(fprintf(stderr, "running %d tasks from group %p in sync\n", count, runtg));
+
         if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
             fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
             exit(1);
         }
 
-        //
-        // Do work for _myTask_
-        //
-        // FIXME: bogus values for thread index/thread count here as well..
-        myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+        lRunBatch(runtg, batch, count, site);
+    }
+    DBG(fprintf(stderr, "sync for %p done!n", tg));
+}
+
+#endif // ISPC_USE_PTHREADS
+
+///////////////////////////////////////////////////////////////////////////
+// Work stealing
+
+#ifdef ISPC_USE_WORK_STEALING
+
+/* A contiguous range [begin, end) of task indices in a task group.  Ranges
+   larger than 'grain' are split before being run. */
+struct TaskRange {
+    TaskGroup *group;
+    int begin, end;
+    int grain;
+    GrainSite *site;        // launch site whose batch size 'grain' is
+    int owner;              // slot whose free list the range goes back to
+    TaskRange *nextFree;
+};
+
+/* Chase-Lev work-stealing deque ("Dynamic Circular Work-Stealing Deque",
+   SPAA 2005), with the C11 memory orderings from Le et al., PPoPP 2013.
+   Only the owning thread calls Push() and Take(); any thread may Steal(). */
+class WorkDeque {
+public:
+    WorkDeque() : top(0), bottom(0) {
+        array.store(new Array(LOG_INITIAL_SIZE), std::memory_order_relaxed);
+    }
+
+    void Push(TaskRange *r) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Array *a = array.load(std::memory_order_relaxed);
+        if (b - t > a->Size() - 1) {
+            a = Grow(a, t, b);
+        }
+        a->Put(b, r);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    TaskRange *Take() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // Empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+        TaskRange *r = a->Get(b);
+        if (t == b) {
+            // Last element; race against thieves for it.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+                r = NULL;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return r;
+    }
+
+    TaskRange *Steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return NULL;
+        Array *a = array.load(std::memory_order_acquire);
+        TaskRange *r = a->Get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+            return NULL;
+        return r;
+    }
+
+    bool Empty() const {
+        return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+    }
+
+    // Approximate when called concurrently with thieves; for tracing only.
+    int Size() const {
+        return (int)std::max(int64_t(0), bottom.load(std::memory_order_relaxed) -
+                                         top.load(std::memory_order_relaxed));
+    }
+
+private:
+    enum { LOG_INITIAL_SIZE = 8 };
+
+    class Array {
+    public:
+        Array(int logSize) : mask((int64_t(1) << logSize) - 1),
+                             slots(new std::atomic<TaskRange *>[mask + 1]),
+                             logSize(logSize) {}
+        ~Array() { delete[] slots; }
+        int64_t Size() const { return mask + 1; }
+        int LogSize() const { return logSize; }
+        TaskRange *Get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void Put(int64_t i, TaskRange *r) { slots[i & mask].store(r, std::memory_order_relaxed); }
+    private:
+        int64_t mask;
+        std::atomic<TaskRange *> *slots;
+        int logSize;
+    };
+
+    Array *Grow(Array *a, int64_t t, int64_t b) {
+        lCountHeapAllocation();
+        Array *na = new Array(a->LogSize() + 1);
+        for (int64_t i = t; i < b; ++i)
+            na->Put(i, a->Get(i));
+        // Thieves may still be reading the old array, so it's kept around
+        // rather than freed.
+        retired.push_back(a);
+        array.store(na, std::memory_order_release);
+        return na;
+    }
+
+    std::atomic<int64_t> top;
+    char pad0[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom;
+    std::atomic<Array *> array;
+    std::vector<Array *> retired;
+    char pad1[64];
+};
+
+/* Per-thread scheduler state.  Slots 0..nThreads-1 belong to the worker
+   threads; the last slot is shared by all threads that aren't workers
+   (typically just the main thread), which serialize on externalLock. */
+struct WorkerState {
+    WorkDeque deque;
+    TaskRange *freeRanges;
+    std::atomic<TaskRange *> returnedRanges; // freed by other slots
+    uint32_t rngState;
+};
+
+static volatile int32_t lock = 0;
+static volatile int32_t externalLock = 0;
+
+static int nThreads;
+static pthread_t *threads = NULL;
+static WorkerState *workers = NULL;
+
+static __thread int lWorkerIndex = -1;
+// Victim selection state of a thread in the external slot; the threads
+// sharing that slot steal without taking externalLock.
+static __thread uint32_t lExternalRngState = 0;
+
+// Idle workers sleep on wakeCond; launches bump workEpoch so that a worker
+// that saw no work before a launch doesn't go to sleep after it.
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static std::atomic<uint32_t> workEpoch(0);
+static std::atomic<int32_t> numSleeping(0);
+
+#define WS_SPIN_ROUNDS 1024
+
+static inline void
+lExternalLock() {
+    while (lAtomicCompareAndSwap32(&externalLock, 1, 0) != 0)
+        lPause();
+}
+
+static inline void
+lExternalUnlock() {
+    lMemFence();
+    externalLock = 0;
+}
+
+static inline int
+lCurrentSlot() {
+    return lWorkerIndex >= 0 ? lWorkerIndex : nThreads;
+}
+
+static inline TaskRange *
+lAllocRange(int slot) {
+    WorkerState *ws = &workers[slot];
+    if (slot == nThreads) lExternalLock();
+    TaskRange *r = ws->freeRanges;
+    if (r == NULL)
+        r = ws->returnedRanges.exchange(NULL, std::memory_order_acquire);
+    if (r != NULL)
+        ws->freeRanges = r->nextFree;
+    if (slot == nThreads) lExternalUnlock();
+    if (r != NULL)
+        return r;
+    lCountHeapAllocation();
+    r = new TaskRange;
+    r->owner = slot;
+    return r;
+}
+
+static inline void
+lFreeRange(int slot, TaskRange *r) {
+    // Ranges go back to the slot that allocated them, so that a thread
+    // that keeps splitting work which others run doesn't have to keep
+    // allocating.  The owner's own list is only touched by the owner (the
+    // shared external slot under the lock); everyone else pushes onto its
+    // returned list, which the owner takes over as a whole.
+    WorkerState *ws = &workers[r->owner];
+    if (r->owner != slot) {
+        TaskRange *head = ws->returnedRanges.load(std::memory_order_relaxed);
+        do {
+            r->nextFree = head;
+        } while (!ws->returnedRanges.compare_exchange_weak(head, r, std::memory_order_release,
+                                                           std::memory_order_relaxed));
+        return;
+    }
+    if (slot == nThreads) lExternalLock();
+    r->nextFree = ws->freeRanges;
+    ws->freeRanges = r;
+    if (slot == nThreads) lExternalUnlock();
+}
+
+static void
+lPushRange(int slot, TaskRange *r) {
+    if (slot == nThreads) {
+        lExternalLock();
+        workers[slot].deque.Push(r);
+        TRACE(lTraceQueue(workers[slot].deque.Size()));
+        lExternalUnlock();
+    }
+    else {
+        workers[slot].deque.Push(r);
+        TRACE(lTraceQueue(workers[slot].deque.Size()));
+    }
+}
+
+static TaskRange *
+lTakeRange(int slot) {
+    if (slot == nThreads) {
+        lExternalLock();
+        TaskRange *r = workers[slot].deque.Take();
+        lExternalUnlock();
+        return r;
+    }
+    return workers[slot].deque.Take();
+}
+
+static void
+lWakeWorkers() {
+    workEpoch.fetch_add(1, std::memory_order_seq_cst);
+    if (numSleeping.load(std::memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&wakeMutex);
+        pthread_cond_broadcast(&wakeCond);
+        pthread_mutex_unlock(&wakeMutex);
+    }
+}
+
+static TaskRange *
+lStealRange(int slot) {
+    uint32_t *rngState = &workers[slot].rngState;
+    if (slot == nThreads) {
+        if (lExternalRngState == 0)
+            lExternalRngState = workers[slot].rngState;
+        rngState = &lExternalRngState;
+    }
+    int nSlots = nThreads + 1;
+    for (int attempt = 0; attempt < 2 * nSlots; ++attempt) {
+        // xorshift32
+        uint32_t x = *rngState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *rngState = x;
+
+        int victim = x % nSlots;
+        if (victim == slot || workers[victim].deque.Empty())
+            continue;
+        TaskRange *r = workers[victim].deque.Steal();
+        if (r != NULL) {
+            TRACE(lTraceSteal(victim));
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Splits the range until it's no bigger than its grain, pushing the upper
+   halves onto our deque where they're available to thieves, then runs the
+   remaining tasks. */
+static void
+lRunRange(int slot, TaskRange *r) {
+    TaskGroup *tg = r->group;
+    int begin = r->begin, end = r->end, grain = r->grain;
+    GrainSite *site = r->site;
+    lFreeRange(slot, r);
+
+    bool pushed = false;
+    while (end - begin > grain) {
+        int mid = begin + (end - begin) / 2;
+        TaskRange *upper = lAllocRange(slot);
+        upper->group = tg;
+        upper->begin = mid;
+        upper->end = end;
+        upper->grain = grain;
+        upper->site = site;
+        lPushRange(slot, upper);
+        pushed = true;
+        end = mid;
+    }
+    if (pushed && numSleeping.load(std::memory_order_relaxed) > 0)
+        lWakeWorkers();
+
+    int64_t start = lNanoseconds();
+    for (int i = begin; i < end; ++i) {
+        TaskInfo *ti = tg->GetTaskInfo(i);
+        TRACE(int64_t taskStart = lTraceNow());
+        ti->func(ti->data, slot, nThreads + 1, ti->taskIndex, ti->taskCount(),
+                 ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
+                 ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        TRACE(lTraceTask(tg, ti->taskIndex, taskStart));
+    }
+    lGrainRecord(site, end - begin, lNanoseconds() - start);
+
+    tg->numUnfinishedTasks.fetch_sub(end - begin, std::memory_order_release);
+}
+
+static inline TaskRange *
+lFindWork(int slot) {
+    TaskRange *r = lTakeRange(slot);
+    if (r == NULL)
+        r = lStealRange(slot);
+    return r;
+}
+
+static void *
+lWorkerEntry(void *arg) {
+    int slot = (int)((int64_t)arg);
+    lWorkerIndex = slot;
+    TRACE(lTraceName("worker", slot));
+
+    while (1) {
+        uint32_t epoch = workEpoch.load(std::memory_order_seq_cst);
+
+        TaskRange *r = NULL;
+        TRACE(int64_t spinStart = lTraceNow());
+        int spin = 0;
+        for (; spin < WS_SPIN_ROUNDS && r == NULL; ++spin) {
+            r = lFindWork(slot);
+            if (r == NULL)
+                lPause();
+        }
+        // Only account the spin if we actually waited; otherwise every
+        // pass through the loop would add an empty event.
+        TRACE(if (r == NULL || spin > 1) lTraceIdle(TRACE_SPIN, spinStart));
+        if (r != NULL) {
+            lRunRange(slot, r);
+            continue;
+        }
 
         //
-        // Decrement the number of unfinished tasks counter
+        // Nothing to do; go to sleep until the next launch.
         //
-        lMemFence();
-        lAtomicAdd(&runtg->numUnfinishedTasks, -1);
+        TRACE(int64_t parkStart = lTraceNow());
+        pthread_mutex_lock(&wakeMutex);
+        numSleeping.fetch_add(1, std::memory_order_seq_cst);
+        while (workEpoch.load(std::memory_order_seq_cst) == epoch)
+            pthread_cond_wait(&wakeCond, &wakeMutex);
+        numSleeping.fetch_sub(1, std::memory_order_seq_cst);
+        pthread_mutex_unlock(&wakeMutex);
+        TRACE(lTraceIdle(TRACE_PARK, parkStart));
     }
-    DBG(fprintf(stderr, "sync for %p done!n", tg));
+
+    pthread_exit(NULL);
+    return 0;
 }
 
-#endif // ISPC_USE_PTHREADS
+
+static void
+InitTaskSystem() {
+    if (threads == NULL) {
+        while (1) {
+            if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+                if (threads == NULL) {
+                    // As with the pthreads model, the thread that syncs
+                    // also runs tasks, so launch one fewer worker than
+                    // there are cores.
+                    nThreads = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN) - 1);
+
+                    workers = new WorkerState[nThreads + 1];
+                    for (int i = 0; i <= nThreads; ++i) {
+                        workers[i].freeRanges = NULL;
+                        workers[i].returnedRanges.store(NULL, std::memory_order_relaxed);
+                        workers[i].rngState = 2463534242u + 977u * i;
+                    }
+
+                    pthread_t *newThreads = new pthread_t[nThreads];
+                    for (int i = 0; i < nThreads; ++i) {
+                        int err = pthread_create(&newThreads[i], NULL, &lWorkerEntry, (void *)((long long)i));
+                        if (err != 0) {
+                            fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
+                            exit(1);
+                        }
+                    }
+
+                    lMemFence();
+                    threads = newThreads;
+                }
+
+                // Make sure all of the above goes to memory before we
+                // clear the lock.
+                lMemFence();
+                lock = 0;
+                break;
+            }
+        }
+    }
+}
+
+
+inline void
+TaskGroup::Launch(int baseIndex, int count) {
+    // Ranges are split down to the site's tuned batch size, but always
+    // into a few batches per thread so that thieves have something to
+    // take.
+    GrainSite *site = lGrainSite((void *)GetTaskInfo(baseIndex)->func);
+    int grain = lGrain(site, count, nThreads + 1);
+
+    numUnfinishedTasks.fetch_add(count, std::memory_order_relaxed);
+
+    int slot = lCurrentSlot();
+    TaskRange *r = lAllocRange(slot);
+    r->group = this;
+    r->begin = baseIndex;
+    r->end = baseIndex + count;
+    r->grain = grain;
+    r->site = site;
+    lPushRange(slot, r);
+
+    lWakeWorkers();
+}
+
+
+inline void
+TaskGroup::Sync() {
+    int slot = lCurrentSlot();
+    TRACE(int64_t spinStart = -1);
+
+    while (numUnfinishedTasks.load(std::memory_order_acquire) > 0) {
+        // Help out while waiting: run our own queued work first, then
+        // steal from others.
+        TaskRange *r = lFindWork(slot);
+        if (r != NULL) {
+            TRACE(if (spinStart >= 0) lTraceIdle(TRACE_SPIN, spinStart));
+            TRACE(spinStart = -1);
+            lRunRange(slot, r);
+        }
+        else {
+            TRACE(if (spinStart < 0) spinStart = lTraceNow());
+            lPause();
+        }
+    }
+    TRACE(if (spinStart >= 0) lTraceIdle(TRACE_SPIN, spinStart));
+}
+
+#endif // ISPC_USE_WORK_STEALING
 
 ///////////////////////////////////////////////////////////////////////////
 // Cilk Plus
@@ -962,9 +2051,11 @@ TaskGroup::Launch(int baseIndex, int count) {
 
         // Actually run the task.
         // Cilk does not expose the task -> thread mapping so we pretend it's 1:1
+        TRACE(int64_t taskStart = lTraceNow());
         ti->func(ti->data, ti->taskIndex, ti->taskCount(),
             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        TRACE(lTraceTask(this, ti->taskIndex, taskStart));
     }
 }
 
@@ -997,9 +2088,11 @@ TaskGroup::Launch(int baseIndex, int count) {
         TaskInfo *ti = GetTaskInfo(baseIndex + i);
 
         // Actually run the task.
+        TRACE(int64_t taskStart = lTraceNow());
         ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        TRACE(lTraceTask(this, ti->taskIndex, taskStart));
     }
   }
 }
@@ -1031,9 +2124,11 @@ TaskGroup::Launch(int baseIndex, int count) {
         int threadIndex = ti->taskIndex;
         int threadCount = ti->taskCount();
 
+        TRACE(int64_t taskStart = lTraceNow());
         ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        TRACE(lTraceTask(this, ti->taskIndex, taskStart));
     });
 }
 
@@ -1060,9 +2155,11 @@ TaskGroup::Launch(int baseIndex, int count) {
             // TBB does not expose the task -> thread mapping so we pretend it's 1:1
             int threadIndex = ti->taskIndex;
             int threadCount = ti->taskCount();
+            TRACE(int64_t taskStart = lTraceNow());
             ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+            TRACE(lTraceTask(this, ti->taskIndex, taskStart));
         });
     }
 }
@@ -1108,18 +2205,31 @@ TaskGroup::Sync() {
 #define MAX_FREE_TASK_GROUPS 64
 static TaskGroup *freeTaskGroups[MAX_FREE_TASK_GROUPS];
 
+// The group most recently synced on this thread.  A function that launches
+// tasks every time it is called gets the same group (with its task queue
+// and argument memory already allocated) back without touching the shared
+// pool, even if nested launches were synced on this thread in between.
+static ISPC_THREAD_LOCAL TaskGroup *lCachedTaskGroup = NULL;
+
 static inline TaskGroup *
 AllocTaskGroup() {
+    TaskGroup *cached = lCachedTaskGroup;
+    if (cached != NULL) {
+        lCachedTaskGroup = NULL;
+        return cached;
+    }
+
     for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
         TaskGroup *tg = freeTaskGroups[i];
         if (tg != NULL) {
             void *ptr = lAtomicCompareAndSwapPointer((void **)(&freeTaskGroups[i]), NULL, tg);
-            if (ptr != NULL) {
-                return (TaskGroup *)ptr;
+            if (ptr == tg) {
+                return tg;
             }
         }
     }
 
+    lCountHeapAllocation();
     return new TaskGroup;
 }
 
@@ -1128,6 +2238,12 @@ static inline void
 FreeTaskGroup(TaskGroup *tg) {
     tg->Reset();
 
+    TaskGroup *cached = lCachedTaskGroup;
+    lCachedTaskGroup = tg;
+    if (cached == NULL)
+        return;
+    tg = cached;
+
     for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
         if (freeTaskGroups[i] == NULL) {
             void *ptr = lAtomicCompareAndSwapPointer((void **)&freeTaskGroups[i], tg, NULL);
@@ -1193,100 +2309,151 @@ ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) {
 
 #else  // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 
-#define MAX_LIVE_TASKS 1024
-
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Small structure used to hold the data for each task
+// threadIndex passed to tasks: 1..nThreads on the workers, 0 on any other
+// thread (those only run tasks while they wait in ISPCSync()).
+static __thread int lThreadIndex = 0;
+// NUMA node (dense index, see TaskSys::createThreads()) of a worker, or -1
+static __thread int lThreadNode = -1;
+
+class Task;
+class TaskGroup;
+// The group last synced on this thread and the launches it held, reused
+// by the next launch from this thread without taking the mutex.
+static __thread TaskGroup *lCachedGroup = NULL;
+static __thread Task *lCachedTasks = NULL;
+
+#define MAX_TASK_NODES 8
+
+// Part of a launch's index space that is handed out to the threads of one
+// NUMA node first; padded so the nodes don't share the cache line.
+struct TaskRange {
+    volatile int32_t next;
+    int32_t end;
+    char pad[64 - 2*sizeof(int32_t)];
+};
+
+// One launch: a grid of up to three dimensions whose tasks are handed out
+// in batches of 'grain' consecutive indices to whichever thread asks next.  When the workers span
+// several NUMA nodes the index space is split into one contiguous range per
+// node, so that task i of every launch with the same count runs on the same
+// node; data first touched by such a launch then stays local to the tasks
+// that use it.  Threads move on to the other nodes' ranges once theirs is
+// exhausted.
 struct Task {
 public:
     TaskFuncType func;
     void *data;
-    volatile int32_t taskIndex;
+    int taskCount3d[3];
     int taskCount;
-
-    volatile int numDone;
-    int liveIndex; // index in live task queue
-
-    inline int  noMoreWork() { return taskIndex >= taskCount; }
-    /*! given thread is done working on this task --> decrease num locks */
-    // inline void lock() { lAtomicAdd(&locks,1); }
-    // inline void unlock() { lAtomicAdd(&locks,-1); }
-    inline int  nextJob() { return lAtomicAdd(&taskIndex,1); }
-    inline int  numJobs() { return taskCount; }
-    inline void schedule(int idx) { taskIndex = 0; numDone = 0; liveIndex = idx; }
-    inline void run(int idx, int threadIdx);
-    inline void markOneDone() { lAtomicAdd(&numDone,1); }
-    inline void wait()
+    int grain;                  // tasks taken at a time, see lGrain()
+    GrainSite *site;
+    int numRanges;
+    TaskRange range[MAX_TASK_NODES];
+
+    volatile int32_t numDone;
+    volatile int32_t users;     // workers that may still touch this task
+    volatile int32_t numParked; // threads sleeping in TaskSys::sync()
+    bool live;                  // linked into TaskSys' live list
+    Task *prevLive, *nextLive;
+    Task *nextInGroup;
+
+    inline int  noMoreWork()
+    {
+        for (int i = 0; i < numRanges; ++i)
+            if (range[i].next < range[i].end) return 0;
+        return 1;
+    }
+    inline void split(int nodes)
     {
-        while (!noMoreWork()) {
-            int next = nextJob();
-            if (next < numJobs()) run(next, 0);
+        numRanges = (nodes > 1 && taskCount >= nodes) ? nodes : 1;
+        for (int i = 0; i < numRanges; ++i) {
+            range[i].next = (int64_t)taskCount * i / numRanges;
+            range[i].end = (int64_t)taskCount * (i + 1) / numRanges;
         }
-        while (numDone != taskCount) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+    }
+    inline void run(int idx);
+    /*! runs tasks until none are left, starting with the given node's range */
+    inline void work(int node)
+    {
+        for (int i = 0; i < numRanges; ++i) {
+            TaskRange &r = range[(node + i) % numRanges];
+            TRACE(bool stolen = false);
+            while (r.next < r.end) {
+                int job = lAtomicAdd(&r.next, grain);
+                if (job >= r.end) break;
+                TRACE(if (i > 0 && !stolen) lTraceSteal((node + i) % numRanges));
+                TRACE(stolen = true);
+                int last = std::min(job + grain, (int)r.end);
+                int64_t start = lNanoseconds();
+                for (int idx = job; idx < last; ++idx)
+                    run(idx);
+                lGrainRecord(site, last - job, lNanoseconds() - start);
+                markDone(last - job);
+            }
         }
     }
-};
-
-///////////////////////////////////////////////////////////////////////////
-class TaskSys {
-    static int numThreadsRunning;
-    struct LiveTask
+    inline void markDone(int n)
     {
-        volatile int locks; /*!< num locks on this task. gets
-                                 initialized to NUM_THREADS+1, then counted
-                                 down by every thread that sees this. this
-                                 value is only valid when 'active' is set
-                                 to true */
-        volatile int active; /*! workers will spin on this until it
-                                 becomes active */
-        Task *task;
-
-        inline void doneWithThis() { lAtomicAdd(&locks,-1); }
-        LiveTask() : active(0), locks(-1) {}
-    };
+        if (lAtomicAdd(&numDone,n) + n == taskCount && numParked > 0)
+            lUnparkAll(&numDone);
+    }
+    /*! given worker won't touch this task anymore */
+    inline void release()
+    {
+        if (lAtomicAdd(&users,-1) - 1 == 0 && numParked > 0)
+            lUnparkAll(&users);
+    }
+};
 
+/*! All launches made from one ispc function, plus the memory for their
+    arguments; ISPCSync() waits for every one of them. */
+class TaskGroup : public TaskGroupBase {
 public:
-    volatile int nextScheduleIndex; /*! next index in the task queue
-                                        where we'll insert a live task */
+    TaskGroup() : tasks(NULL) {}
+    void Reset() { TaskGroupBase::Reset(); tasks = NULL; }
+    void Launch(Task *task) { task->nextInGroup = tasks; tasks = task; }
 
-    // inline int inc_begin() { int old = begin; begin = (begin+1)%MAX_TASKS; return old; }
-    // inline int inc_end() { int old = end; end = (end+1)%MAX_TASKS; return old; }
+    Task *tasks; // most recent launch first
+};
 
-    LiveTask taskQueue[MAX_LIVE_TASKS];
-    std::stack<Task *> taskMem;
+///////////////////////////////////////////////////////////////////////////
+class TaskSys {
+public:
+    /*! launches that may still have tasks to hand out, oldest first.
+        Workers unlink the ones they find exhausted, sync() the rest. */
+    Task *liveHead, *liveTail;
+    std::vector<Task *> freeTasks;
+    std::vector<TaskGroup *> freeGroups;
+
+    volatile int32_t scheduleEpoch; /*! bumped on every schedule(); idle
+                                        workers park on it */
+    volatile int32_t numParkedWorkers;
+    volatile int32_t numWorkersStarted;
+
+    int numNodes;                //!< NUMA nodes the workers run on, at most MAX_TASK_NODES
+    std::vector<int> workerNode; //!< dense node index of each worker
+    std::vector<int> cpuNode;    //!< dense node index of each CPU, for the other threads
+
+    /*! dense node index of the calling thread */
+    inline int currentNode()
+    {
+        if (lThreadNode >= 0 || numNodes <= 1)
+            return std::max(lThreadNode, 0);
+        int cpu = sched_getcpu();
+        return (cpu >= 0 && cpu < (int)cpuNode.size()) ? cpuNode[cpu] : 0;
+    }
 
     static TaskSys *global;
 
-    TaskSys() : nextScheduleIndex(0)
+    TaskSys() : liveHead(NULL), liveTail(NULL), scheduleEpoch(0),
+                numParkedWorkers(0), numWorkersStarted(0), numNodes(1)
     {
         TaskSys::global = this;
-        Task *mem = new Task[MAX_LIVE_TASKS]; //< could actually be more than _live_ tasks
-        for (int i=0;i<MAX_LIVE_TASKS;i++) {
-            taskMem.push(mem+i);
-        }
         createThreads();
     }
 
-    inline Task *allocOne()
-    {
-        pthread_mutex_lock(&mutex);
-        if (taskMem.empty()) {
-            fprintf(stderr, "Too many live tasks.  "
-                    "Change the value of MAX_LIVE_TASKS and recompile.\n");
-            exit(1);
-        }
-        Task *task = taskMem.top();
-        taskMem.pop();
-        pthread_mutex_unlock(&mutex);
-        return task;
-    }
-
     static inline void init()
     {
         if (global) return;
@@ -1301,38 +2468,120 @@ public:
 
     void threadFct();
 
+    inline Task *allocOne()
+    {
+        if (lCachedTasks != NULL) {
+            Task *task = lCachedTasks;
+            lCachedTasks = task->nextInGroup;
+            return task;
+        }
+        pthread_mutex_lock(&mutex);
+        Task *task;
+        if (freeTasks.empty()) {
+            lCountHeapAllocation();
+            task = new Task;
+        } else {
+            task = freeTasks.back();
+            freeTasks.pop_back();
+        }
+        pthread_mutex_unlock(&mutex);
+        return task;
+    }
+
+    inline TaskGroup *allocGroup()
+    {
+        if (lCachedGroup != NULL) {
+            TaskGroup *tg = lCachedGroup;
+            lCachedGroup = NULL;
+            return tg;
+        }
+        pthread_mutex_lock(&mutex);
+        TaskGroup *tg;
+        if (freeGroups.empty()) {
+            lCountHeapAllocation();
+            tg = new TaskGroup;
+        } else {
+            tg = freeGroups.back();
+            freeGroups.pop_back();
+        }
+        pthread_mutex_unlock(&mutex);
+        return tg;
+    }
+
+    // Callers hold the mutex.
+    inline void unlink(Task *t)
+    {
+        if (t->prevLive) t->prevLive->nextLive = t->nextLive;
+        else liveHead = t->nextLive;
+        if (t->nextLive) t->nextLive->prevLive = t->prevLive;
+        else liveTail = t->prevLive;
+        t->live = false;
+    }
+
     inline void schedule(Task *t)
     {
         pthread_mutex_lock(&mutex);
-        int liveIndex = nextScheduleIndex;
-        nextScheduleIndex = (nextScheduleIndex+1)%MAX_LIVE_TASKS;
-        if (taskQueue[liveIndex].active) {
-            fprintf(stderr, "Out of task queue resources.  "
-                    "Change the value of MAX_LIVE_TASKS and recompile.\n");
-            exit(1);
+        t->prevLive = liveTail;
+        t->nextLive = NULL;
+        if (liveTail) liveTail->nextLive = t;
+        else liveHead = t;
+        liveTail = t;
+        t->live = true;
+        TRACE(int numLive = 0);
+        TRACE(for (Task *l = liveHead; l != NULL; l = l->nextLive) ++numLive);
+        pthread_mutex_unlock(&mutex);
+        TRACE(lTraceQueue(numLive));
+
+        lAtomicAdd(&scheduleEpoch, 1);
+        if (numParkedWorkers > 0)
+            lUnparkAll(&scheduleEpoch);
+    }
+
+    /*! returns the oldest launch with tasks left, counting the caller as
+        one of its users, or NULL if there's nothing to do */
+    inline Task *acquire()
+    {
+        pthread_mutex_lock(&mutex);
+        Task *t = liveHead;
+        while (t != NULL && t->noMoreWork()) {
+            Task *next = t->nextLive;
+            unlink(t);
+            t = next;
         }
-        taskQueue[liveIndex].task = t;
-        t->schedule(liveIndex);
-        taskQueue[liveIndex].locks = numThreadsRunning+1; // num _worker_ threads plus creator
-        taskQueue[liveIndex].active = true;
+        if (t != NULL)
+            lAtomicAdd(&t->users, 1);
         pthread_mutex_unlock(&mutex);
+        return t;
     }
 
-    void sync(Task *task)
+    /*! Runs the tasks nobody has picked up yet on the calling thread, so
+        that nested launches make progress even when every worker is busy
+        in an enclosing one, then waits for the rest. */
+    void sync(TaskGroup *tg)
     {
-        task->wait();
-        int liveIndex = task->liveIndex;
-        while (taskQueue[liveIndex].locks > 1) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+        int node = currentNode();
+        for (Task *t = tg->tasks; t != NULL; t = t->nextInGroup) {
+            t->work(node);
+            lSpinThenPark(&t->numDone, &t->numParked, [t] { return t->numDone == t->taskCount; });
+            pthread_mutex_lock(&mutex);
+            if (t->live)
+                unlink(t);
+            pthread_mutex_unlock(&mutex);
+            lSpinThenPark(&t->users, &t->numParked, [t] { return t->users == 0; });
         }
-        _mm_free(task->data);
+        // Keep this group for the next launch from this thread and hand
+        // back the one kept before, if any.
+        Task *tasks = tg->tasks;
+        tg->Reset();
+        std::swap(tasks, lCachedTasks);
+        std::swap(tg, lCachedGroup);
+        if (tg == NULL && tasks == NULL)
+            return;
         pthread_mutex_lock(&mutex);
-        taskMem.push(task); // recycle task index
-        taskQueue[liveIndex].active = false;
+        for (Task *t = tasks; t != NULL; t = t->nextInGroup)
+            freeTasks.push_back(t);
+        if (tg != NULL)
+            freeGroups.push_back(tg);
         pthread_mutex_unlock(&mutex);
     }
 };
@@ -1340,32 +2589,31 @@ public:
 
 void TaskSys::threadFct()
 {
-    int myIndex = 0; //lAtomicAdd(&threadIdx,1);
+    lThreadIndex = lAtomicAdd(&numWorkersStarted, 1) + 1;
+    lThreadNode = workerNode[lThreadIndex - 1];
+    TRACE(lTraceName("worker", lThreadIndex - 1));
     while (1) {
-        while (!taskQueue[myIndex].active) {
-#ifndef ISPC_IS_KNC
-            usleep(4);
-#else
-            _mm_delay_32(32);
-#endif
+        int32_t epoch = scheduleEpoch;
+        Task *mine = acquire();
+        if (mine == NULL) {
+            lSpinThenPark(&scheduleEpoch, &numParkedWorkers,
+                          [this, epoch] { return scheduleEpoch != epoch; });
             continue;
         }
-
-        Task *mine = taskQueue[myIndex].task;
-        while (!mine->noMoreWork()) {
-            int job = mine->nextJob();
-            if (job >= mine->numJobs()) break;
-            mine->run(job,myIndex);
-        }
-        taskQueue[myIndex].doneWithThis();
-        myIndex = (myIndex+1)%MAX_LIVE_TASKS;
+        mine->work(lThreadNode);
+        mine->release();
     }
 }
 
 
-inline void Task::run(int idx, int threadIdx) {
-    (*this->func)(data,threadIdx,TaskSys::global->nThreads,idx,taskCount);
-    markOneDone();
+inline void Task::run(int idx) {
+    int i0 = idx % taskCount3d[0];
+    int i1 = (idx / taskCount3d[0]) % taskCount3d[1];
+    int i2 = idx / (taskCount3d[0] * taskCount3d[1]);
+    TRACE(int64_t taskStart = lTraceNow());
+    (*this->func)(data, lThreadIndex, TaskSys::global->nThreads + 1, idx, taskCount,
+                  i0, i1, i2, taskCount3d[0], taskCount3d[1], taskCount3d[2]);
+    TRACE(lTraceTask(this, idx, taskStart));
 }
 
 
@@ -1375,29 +2623,214 @@ void *_threadFct(void *data) {
 }
 
 
+// CPU topology and thread placement
+//
+// The CPUs we may run on come from sched_getaffinity(), so taskset masks and
+// cgroup cpusets are honored; their core and package ids come from
+// /sys/devices/system/cpu/cpuN/topology.  Worker placement is controlled by
+// two environment variables:
+//
+//   ISPC_TASKSYS_THREADS=<n>       number of worker threads (default: one per
+//                                  CPU of the policy, minus one for the
+//                                  launching thread)
+//   ISPC_TASKSYS_AFFINITY=<policy> compact  fill both SMT siblings of a core
+//                                           before moving to the next core
+//                                  scatter  round-robin over packages, then
+//                                           cores; SMT siblings come last
+//                                  cores    one thread per physical core
+//                                  none     don't pin the workers
+//
+// The first CPU of the chosen order is left to the launching thread, which
+// runs tasks too while it waits in ISPCSync().  A summary of the placement
+// (threads, policy and topology) is printed to stderr when the task system
+// starts, so that scaling runs record what they ran on; with
+// ISPC_TASKSYS_PLACEMENT=report, the CPU of every worker is printed too.
+//
+// The NUMA node of each CPU is taken from its /sys/devices/system/cpu/cpuN/nodeM
+// link.  If the pinned workers span more than one node, every launch is split
+// into one index range per node (see Task); numa.h allocates the examples'
+// data to match.
+
+struct CpuInfo {
+    int cpu;
+    int core;     // core_id, unique within a package
+    int package;  // physical_package_id
+    int node;     // NUMA node
+    int smt;      // rank among the allowed SMT siblings of this core
+    int coreRank; // rank of this core within its package
+};
+
+enum AffinityPolicy { AFFINITY_COMPACT, AFFINITY_SCATTER, AFFINITY_CORES, AFFINITY_NONE };
+static const char *lAffinityNames[] = { "compact", "scatter", "cores", "none" };
+
+static int
+lReadTopologyId(int cpu, const char *name, int fallback) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return fallback;
+    int id;
+    if (fscanf(fp, "%d", &id) != 1 || id < 0)
+        id = fallback;
+    fclose(fp);
+    return id;
+}
+
+static int
+lReadNodeId(int cpu, int fallback) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return fallback;
+    int node = fallback;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
+    closedir(dir);
+    return node;
+}
+
+static bool
+lCompactOrder(const CpuInfo &a, const CpuInfo &b) {
+    if (a.package != b.package) return a.package < b.package;
+    if (a.core != b.core) return a.core < b.core;
+    return a.cpu < b.cpu;
+}
+
+static bool
+lScatterOrder(const CpuInfo &a, const CpuInfo &b) {
+    if (a.smt != b.smt) return a.smt < b.smt;
+    if (a.coreRank != b.coreRank) return a.coreRank < b.coreRank;
+    return a.package < b.package;
+}
+
+// Returns the CPUs this process may run on, in compact order.
+static std::vector<CpuInfo>
+lDiscoverTopology() {
+    std::vector<CpuInfo> cpus;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0) {
+        int n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 0; i < n && i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &mask);
+    }
+
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (!CPU_ISSET(i, &mask))
+            continue;
+        CpuInfo info;
+        info.cpu = i;
+        info.core = lReadTopologyId(i, "core_id", i);
+        info.package = lReadTopologyId(i, "physical_package_id", 0);
+        info.node = lReadNodeId(i, info.package);
+        info.smt = 0;
+        info.coreRank = 0;
+        cpus.push_back(info);
+    }
+
+    std::sort(cpus.begin(), cpus.end(), lCompactOrder);
+    for (size_t i = 1; i < cpus.size(); ++i) {
+        const CpuInfo &prev = cpus[i - 1];
+        if (cpus[i].package != prev.package) {
+            cpus[i].coreRank = 0;
+        } else if (cpus[i].core != prev.core) {
+            cpus[i].coreRank = prev.coreRank + 1;
+        } else {
+            cpus[i].coreRank = prev.coreRank;
+            cpus[i].smt = prev.smt + 1;
+        }
+    }
+    return cpus;
+}
+
+static AffinityPolicy
+lAffinityPolicy() {
+    const char *env = getenv("ISPC_TASKSYS_AFFINITY");
+    if (env == NULL || *env == '\0')
+        return AFFINITY_COMPACT;
+    for (int i = 0; i <= AFFINITY_NONE; ++i)
+        if (strcmp(env, lAffinityNames[i]) == 0)
+            return (AffinityPolicy)i;
+    fprintf(stderr, "Unknown ISPC_TASKSYS_AFFINITY \"%s\", using compact\n", env);
+    return AFFINITY_COMPACT;
+}
+
+
 void TaskSys::createThreads()
 {
     init();
-    int reserved = 4;
-    int minid = 2;
-    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - reserved;
+
+    std::vector<CpuInfo> cpus = lDiscoverTopology();
+    int numCores = 0, numPackages = 0;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (cpus[i].smt == 0)
+            ++numCores;
+        if (i == 0 || cpus[i].package != cpus[i - 1].package)
+            ++numPackages;
+    }
+
+    AffinityPolicy policy = lAffinityPolicy();
+    std::vector<CpuInfo> order;
+    for (size_t i = 0; i < cpus.size(); ++i)
+        if (policy != AFFINITY_CORES || cpus[i].smt == 0)
+            order.push_back(cpus[i]);
+    if (policy == AFFINITY_SCATTER)
+        std::stable_sort(order.begin(), order.end(), lScatterOrder);
+
+    nThreads = std::max(1, (int)order.size() - 1);
+    const char *env = getenv("ISPC_TASKSYS_THREADS");
+    if (env != NULL && atoi(env) > 0)
+        nThreads = atoi(env);
 
     thread = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
 
-    numThreadsRunning = 0;
+    // Number the NUMA nodes the workers are pinned to densely; launches are
+    // only split by node when there is more than one of them.
+    std::vector<int> nodeIds;
+    for (size_t i = 0; i < order.size(); ++i)
+        nodeIds.push_back(order[i].node);
+    std::sort(nodeIds.begin(), nodeIds.end());
+    nodeIds.erase(std::unique(nodeIds.begin(), nodeIds.end()), nodeIds.end());
+    numNodes = policy == AFFINITY_NONE ? 1 : std::max(1, std::min((int)nodeIds.size(), MAX_TASK_NODES));
+    cpuNode.assign(CPU_SETSIZE, 0);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        std::vector<int>::iterator it = std::lower_bound(nodeIds.begin(), nodeIds.end(), cpus[i].node);
+        if (it != nodeIds.end() && *it == cpus[i].node)
+            cpuNode[cpus[i].cpu] = (it - nodeIds.begin()) % numNodes;
+    }
+    workerNode.assign(nThreads, 0);
+
+    env = getenv("ISPC_TASKSYS_PLACEMENT");
+    bool report = env != NULL && strcmp(env, "report") == 0;
+    fprintf(stderr, "tasksys: %d worker threads, affinity %s, %d CPUs, %d cores, %d packages, %d NUMA nodes",
+            nThreads, lAffinityNames[policy], (int)cpus.size(), numCores, numPackages, (int)nodeIds.size());
+    if (policy != AFFINITY_NONE && (int)order.size() <= nThreads)
+        fprintf(stderr, " (oversubscribed)");
+    fprintf(stderr, "\n");
+
     for (int i = 0; i < nThreads; ++i) {
         pthread_attr_t attr;
         pthread_attr_init(&attr);
         pthread_attr_setstacksize(&attr, 2*1024 * 1024);
 
-        int threadID = minid+i;
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(threadID,&cpuset);
-        int ret = pthread_attr_setaffinity_np(&attr,sizeof(cpuset),&cpuset);
+        if (policy != AFFINITY_NONE && !order.empty()) {
+            const CpuInfo &c = order[(i + 1) % order.size()];
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(c.cpu, &cpuset);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+            workerNode[i] = cpuNode[c.cpu];
+            if (report)
+                fprintf(stderr, "tasksys: worker %d -> cpu %d (package %d, core %d, smt %d, node %d)\n",
+                        i, c.cpu, c.package, c.core, c.smt, c.node);
+        }
 
         int err = pthread_create(&thread[i], &attr, &_threadFct, this);
-        ++numThreadsRunning;
+        pthread_attr_destroy(&attr);
         if (err != 0) {
             fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
             exit(1);
@@ -1406,34 +2839,48 @@ void TaskSys::createThreads()
 }
 
 TaskSys * TaskSys::global = NULL;
-int TaskSys::numThreadsRunning = 0;
 
 ///////////////////////////////////////////////////////////////////////////
 
-void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count)
+static inline TaskGroup *
+lGetTaskGroup(void **taskGroupPtr) {
+    if (*taskGroupPtr == NULL) {
+        TaskSys::init();
+        *taskGroupPtr = TaskSys::global->allocGroup();
+    }
+    return (TaskGroup *)(*taskGroupPtr);
+}
+
+void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2)
 {
-    Task *ti = *(Task**)taskGroupPtr;
+    TaskGroup *taskGroup = lGetTaskGroup(taskGroupPtr);
+    Task *ti = TaskSys::global->allocOne();
     ti->func = (TaskFuncType)func;
     ti->data = data;
-    ti->taskIndex = 0;
-    ti->taskCount = count;
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
+    ti->taskCount = count0*count1*count2;
+    ti->site = lGrainSite(func);
+    ti->grain = lGrain(ti->site, ti->taskCount, TaskSys::global->nThreads + 1);
+    ti->split(TaskSys::global->numNodes);
+    ti->numDone = 0;
+    ti->users = 0;
+    ti->numParked = 0;
+    taskGroup->Launch(ti);
     TaskSys::global->schedule(ti);
 }
 
 void ISPCSync(void *h)
 {
-    Task *task = (Task *)h;
-    assert(task);
-    TaskSys::global->sync(task);
+    TaskGroup *taskGroup = (TaskGroup *)h;
+    if (taskGroup != NULL)
+        TaskSys::global->sync(taskGroup);
 }
 
 void *ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment)
 {
-    TaskSys::init();
-    Task *task = TaskSys::global->allocOne();
-    *taskGroupPtr = task;
-    task->data = _mm_malloc(size,alignment);
-    return task->data;//*taskGroupPtr;
+    return lGetTaskGroup(taskGroupPtr)->AllocMemory(size, alignment);
 }
 
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
@@ -31,102 +31,205 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef TIMING_H
+#define TIMING_H
+
+/*
+  Timers used by the example drivers.
+
+  Intervals are measured with the time stamp counter: the start of an
+  interval is read with "lfence; rdtsc" and the end with "rdtscp; lfence",
+  so the timed code can neither be hoisted above nor sunk below the counter
+  reads, without paying for a full cpuid serialization on every call.  The
+  counter is calibrated once per process against CLOCK_MONOTONIC_RAW, which
+  lets every interval be reported both in reference cycles and in real
+  nanoseconds.  Without an invariant TSC the nanosecond values come
+  straight from the monotonic clock, and on targets without a TSC the
+  "cycles" are nanoseconds (i.e. a pretend 1GHz clock).
+
+  Timer objects are independent, so every thread (or task) can time itself
+  with its own Timer.  The reset_and_start_timer()/get_elapsed_*() calls
+  used by the drivers operate on a thread-local Timer.
+*/
+
 #include <stdint.h>
+#include <stdio.h>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define TIMING_HAS_TSC
+#if !defined(_WIN32)
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define TIMING_THREAD_LOCAL __declspec(thread)
+#else
+#define TIMING_THREAD_LOCAL __thread
+#endif
 
-#ifdef __arm__
-#include <sys/time.h>
-// There's no easy way to get a hardware clock counter on ARM, so instead
-// we'll pretend it's a 1GHz processor and then compute pretend cycles
-// based on elapsed time from gettimeofday().
-__inline__ uint64_t rdtsc() {
-  static bool first = true;
-  static struct timeval tv_start;
-  if (first) {
-    gettimeofday(&tv_start, NULL);
-    first = false;
-    return 0;
-  }
-
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  tv.tv_sec -= tv_start.tv_sec;
-  tv.tv_usec -= tv_start.tv_usec;
-  return (1000000ull * tv.tv_sec + tv.tv_usec) * 1000ull;
+/* Nanoseconds from a monotonic clock that is not slewed by NTP. */
+static inline uint64_t clock_ns() {
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
 }
 
-#include <sys/time.h>
-static inline double rtc(void)
-{
-  struct timeval Tvalue;
-  double etime;
-  struct timezone dummy;
-
-  gettimeofday(&Tvalue,&dummy);
-  etime =  (double) Tvalue.tv_sec +
-    1.e-6*((double) Tvalue.tv_usec);
-  return etime;
+/* Reads the counter at the start of an interval; the lfence keeps the
+   read from being executed before earlier instructions complete. */
+static inline uint64_t rdtsc_start() {
+#if !defined(TIMING_HAS_TSC)
+    return clock_ns();
+#elif defined(_WIN32)
+    _mm_lfence();
+    return __rdtsc();
+#else
+    uint32_t low, high;
+    __asm__ __volatile__ ("lfence\n\trdtsc" : "=a" (low), "=d" (high) :: "memory");
+    return (uint64_t)high << 32 | low;
+#endif
 }
 
-#else // __arm__
+/* Reads the counter at the end of an interval; rdtscp waits for the timed
+   code to retire and the trailing lfence keeps later code from starting
+   before the read. */
+static inline uint64_t rdtsc_stop() {
+#if !defined(TIMING_HAS_TSC)
+    return clock_ns();
+#elif defined(_WIN32)
+    unsigned int aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+#else
+    uint32_t low, high;
+    __asm__ __volatile__ ("rdtscp\n\tlfence" : "=a" (low), "=d" (high) :: "%ecx", "memory");
+    return (uint64_t)high << 32 | low;
+#endif
+}
 
-#ifdef WIN32
-#include <windows.h>
-#define rdtsc __rdtsc
-#else // WIN32
-__inline__ uint64_t rdtsc() {
-  uint32_t low, high;
-#ifdef __x86_64
-  __asm__ __volatile__ ("xorl %%eax,%%eax \n    cpuid"
-                        ::: "%rax", "%rbx", "%rcx", "%rdx" );
+static inline uint64_t rdtsc() { return rdtsc_start(); }
+
+/* True if the TSC ticks at a constant rate regardless of P/C-states
+   (CPUID 0x80000007, EDX bit 8). */
+static inline bool tsc_is_invariant() {
+#if !defined(TIMING_HAS_TSC)
+    return false;
+#elif defined(_WIN32)
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if ((unsigned int)regs[0] < 0x80000007u) return false;
+    __cpuid(regs, 0x80000007);
+    return (regs[3] >> 8) & 1;
 #else
-  __asm__ __volatile__ ("xorl %%eax,%%eax \n    cpuid"
-                        ::: "%eax", "%ebx", "%ecx", "%edx" );
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+    return (edx >> 8) & 1;
 #endif
-  __asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
-  return (uint64_t)high << 32 | low;
 }
 
-#include <sys/time.h>
-static inline double rtc(void)
-{
-  struct timeval Tvalue;
-  double etime;
-  struct timezone dummy;
-
-  gettimeofday(&Tvalue,&dummy);
-  etime =  (double) Tvalue.tv_sec +
-    1.e-6*((double) Tvalue.tv_usec);
-  return etime;
+/* Measures TSC ticks per nanosecond over a few short windows and keeps
+   the median, so a single preempted window can't skew the result.
+   Returns 0 if the TSC can't be used as a wall clock. */
+static inline double tsc_calibrate() {
+    if (!tsc_is_invariant())
+        return 0.0;
+
+    double ratio[3];
+    for (int i = 0; i < 3; ++i) {
+        uint64_t ns0 = clock_ns(), t0 = rdtsc_start();
+        uint64_t ns1, t1;
+        do {
+            t1 = rdtsc_start();
+            ns1 = clock_ns();
+        } while (ns1 - ns0 < 5000000);
+        ratio[i] = (double)(t1 - t0) / (double)(ns1 - ns0);
+    }
+    if (ratio[0] > ratio[1]) { double t = ratio[0]; ratio[0] = ratio[1]; ratio[1] = t; }
+    if (ratio[1] > ratio[2]) { double t = ratio[1]; ratio[1] = ratio[2]; ratio[2] = t; }
+    if (ratio[0] > ratio[1]) { double t = ratio[0]; ratio[0] = ratio[1]; ratio[1] = t; }
+    return ratio[1];
+}
+
+/* TSC ticks per nanosecond, or 0 when nanoseconds have to be taken from
+   the clock.  The calibration runs once per process, during static
+   initialization. */
+inline double tsc_ticks_per_ns() {
+    static const double ratio = tsc_calibrate();
+    return ratio;
+}
+
+static const double tsc_startup_ratio = tsc_ticks_per_ns();
+
+struct Timer {
+    uint64_t startTicks;
+    uint64_t startNs;
+};
+
+struct TimerSample {
+    uint64_t cycles;  // reference cycles
+    double   ns;      // wall time
+};
+
+static inline void timer_start(Timer *t) {
+    t->startNs = tsc_ticks_per_ns() > 0.0 ? 0 : clock_ns();
+    t->startTicks = rdtsc_start();
+}
+
+static inline TimerSample timer_stop(const Timer *t) {
+    TimerSample s;
+    uint64_t ticks = rdtsc_stop();
+    double ratio = tsc_ticks_per_ns();
+    s.cycles = ticks - t->startTicks;
+    s.ns = ratio > 0.0 ? (double)s.cycles / ratio : (double)(clock_ns() - t->startNs);
+    return s;
 }
 
-#endif // !WIN32
-#endif // !__arm__
+/* Seconds since an arbitrary point, for coarse timing. */
+static inline double rtc(void) {
+    return (double)clock_ns() * 1e-9;
+}
 
-static uint64_t start,  end;
-static double  tstart, tend;
+static TIMING_THREAD_LOCAL Timer threadTimer;
 
 static inline void reset_and_start_timer()
 {
-    start = rdtsc();
-#ifndef WIN32
-    // Unused in Windows build, rtc() causing link errors
-    tstart = rtc();
-#endif
+    timer_start(&threadTimer);
 }
 
-/* Returns the number of millions of elapsed processor cycles since the
-   last reset_and_start_timer() call. */
+/* Returns the number of millions of elapsed reference cycles since the
+   last reset_and_start_timer() call on this thread. */
 static inline double get_elapsed_mcycles()
 {
-    end = rdtsc();
-    return (end-start) / (1024. * 1024.);
+    return timer_stop(&threadTimer).cycles * 1e-6;
 }
 
-#ifndef WIN32
-// Unused in Windows build, rtc() causing link errors
+/* Returns the number of elapsed milliseconds since the last
+   reset_and_start_timer() call on this thread. */
 static inline double get_elapsed_msec()
 {
-    tend = rtc();
-    return (tend - tstart)*1e3;
+    return timer_stop(&threadTimer).ns * 1e-6;
 }
-#endif
+
+#endif // TIMING_H
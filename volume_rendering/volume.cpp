@@ -41,16 +41,18 @@
 #include <cstdlib>
 #include <stdio.h>
 #include <algorithm>
-#include "../timing.h"
+#include "../bench.h"
+#include "../numa.h"
 #include "volume_ispc.h"
 using namespace ispc;
 
 extern void volume_serial(float density[], int nVoxels[3], const float raster2camera[4][4], const float camera2world[4][4], int width, int height, float image[]);
 extern "C" void volume_impala(float density[], int nVoxels[3], const float raster2camera[4][4], const float camera2world[4][4], int width, int height, float image[]);
+extern "C" void volume_impala_tasks(float density[], int nVoxels[3], const float raster2camera[4][4], const float camera2world[4][4], int width, int height, float image[]);
 
 /* Write a PPM image file with the image */
 static void
-writePPM(float *buf, int width, int height, const char *fn) {
+writePPM(float *buf, int width, int height, const char *fn, FILE *log) {
     FILE *fp = fopen(fn, "wb");
     fprintf(fp, "P6\n");
     fprintf(fp, "%d %d\n", width, height);
@@ -64,7 +66,7 @@ writePPM(float *buf, int width, int height, const char *fn) {
             fputc(c, fp);
     }
     fclose(fp);
-    printf("Wrote image file %s\n", fn);
+    fprintf(log, "Wrote image file %s\n", fn);
 }
 
 
@@ -121,7 +123,7 @@ loadVolume(const char *fn, int n[3]) {
     }
 
     int count = n[0] * n[1] * n[2];
-    float *v = new float[count];
+    float *v = numa_new<float>(count);
     for (int i = 0; i < count; ++i) {
         if (fscanf(f, "%f", &v[i]) != 1) {
             fprintf(stderr, "Unexpected end of file at %d'th density value\n", i);
@@ -134,9 +136,12 @@ loadVolume(const char *fn, int n[3]) {
 
 
 int main(int argc, char *argv[]) {
-    static unsigned int test_iterations[] = {3, 7, 1};
+    // 0 leaves the number of runs to the benchmark harness
+    static unsigned int test_iterations[] = {0, 0, 0};
+    Bench bench("volume");
+    argc = bench.parseArgs(argc, argv);
     if (argc < 3) {
-        fprintf(stderr, "usage: volume <camera.dat> <volume_density.vol> [ispc iterations] [tasks iterations] [serial iterations]\n");
+        fprintf(stderr, "usage: volume <camera.dat> <volume_density.vol> [ispc iterations] [impala iterations] [serial iterations]\n");
         return 1;
     }
     if (argc == 6) {
@@ -151,67 +156,26 @@ int main(int argc, char *argv[]) {
     int width, height;
     float raster2camera[4][4], camera2world[4][4];
     loadCamera(argv[1], &width, &height, raster2camera, camera2world);
-    float *image = new float[width*height];
+    float *image = numa_new<float>(width*height);
 
     int n[3];
     float *density = loadVolume(argv[2], n);
 
-    //
-    // Compute the image using the ispc implementation; report the minimum
-    // time of three runs.
-    //
-    double minISPC = 1e30;
-    for (unsigned int i = 0; i < test_iterations[0]; ++i) {
-        reset_and_start_timer();
-        volume_ispc(density, n, raster2camera, camera2world, width, height, image);
-        double dt = get_elapsed_mcycles();
-        printf("@time of ISPC run:\t\t\t[%.3f] million cycles\n", dt);
-        minISPC = std::min(minISPC, dt);
-    }
-
-    printf("[volume ispc 1 core]:\t\t[%.3f] million cycles\n", minISPC);
-    writePPM(image, width, height, "volume-ispc-1core.ppm");
-
-    // Clear out the buffer
-    for (int i = 0; i < width * height; ++i)
+#define BENCH(iter, fn, name) \
+    bench.run(name, iter, [&] { fn(density, n, raster2camera, camera2world, width, height, image); }); \
+    writePPM(image, width, height, "volume-" name ".ppm", bench.logFile()); \
+    for (int i = 0; i < width * height; ++i) \
         image[i] = 0.;
 
-    // anydsl
-    double minImpala = 1e30;
-    for (unsigned int i = 0; i < test_iterations[1]; ++i) {
-        reset_and_start_timer();
-        volume_impala(density, n, raster2camera, camera2world, width, height, image);
-        double dt = get_elapsed_mcycles();
-        printf("@time of impala run:\t\t\t[%.3f] million cycles\n", dt);
-        minImpala = std::min(minImpala, dt);
-    }
-
-    printf("[volume impala]:\t\t[%.3f] million cycles\n", minImpala);
-    writePPM(image, width, height, "volume-impala.ppm");
-
-    // Clear out the buffer
-    for (int i = 0; i < width * height; ++i)
-        image[i] = 0.;
-
-    //
-    // And run the serial implementation 3 times, again reporting the
-    // minimum time.
-    //
-    double minSerial = 1e30;
-    for (unsigned int i = 0; i < test_iterations[2]; ++i) {
-        reset_and_start_timer();
-        volume_serial(density, n, raster2camera, camera2world,
-                      width, height, image);
-        double dt = get_elapsed_mcycles();
-        printf("@time of serial run:\t\t\t[%.3f] million cycles\n", dt);
-        minSerial = std::min(minSerial, dt);
-    }
-
-    printf("[volume serial]:\t\t[%.3f] million cycles\n", minSerial);
-    writePPM(image, width, height, "volume-serial.ppm");
-
-    //printf("\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from ISPC + tasks)\n",
-           //minSerial/minISPC, minSerial / minISPCtasks);
+    BENCH(test_iterations[0], volume_ispc,   "ispc")
+    BENCH(test_iterations[1], volume_impala, "impala")
+    BENCH(test_iterations[0], volume_ispc_tasks,   "ispc-tasks")
+    BENCH(test_iterations[1], volume_impala_tasks, "impala-tasks")
+    BENCH(test_iterations[2], volume_serial, "serial")
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC, %.2fx speedup from AnyDSL)\n",
+            bench.speedup("serial", "ispc"), bench.speedup("serial", "impala"));
+    fprintf(bench.logFile(), "\t\t\t\t(%.2fx speedup from ISPC + tasks, %.2fx speedup from AnyDSL + parallel)\n",
+            bench.speedup("serial", "ispc-tasks"), bench.speedup("serial", "impala-tasks"));
 
     return 0;
 }